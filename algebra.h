@@ -2,6 +2,7 @@
 #define _ICON_FITTER_ALGEBRA_
 
 #include <cmath>
+#include <cstring>
 #include <iostream>
 
 #define _USE_MATH_DEFINES
@@ -51,7 +52,53 @@ namespace icon_fitter {
         }
         return result;
       }
+
+      // Same as Compute when the distance is below bound. Otherwise it
+      // may stop early and return any value not below bound.
+      template <typename VectorType>
+      static double ComputeBounded(const VectorType &a, const VectorType &b,
+                                   double bound) {
+        const int size = a.size();
+        double result = 0.0;
+        for (int begin = 0; begin < size; begin += kBoundCheck) {
+          int end = begin + kBoundCheck < size ? begin + kBoundCheck : size;
+          for (int i = begin; i < end; ++i) {
+            double x = a[i] - b[i];
+            result += x * x;
+          }
+          if (result >= bound) return result;
+        }
+        return result;
+      }
+
+      // Elements between checks against the bound.
+      static constexpr int kBoundCheck = 32;
     };
+
+    // ---------- Bounded Distances ----------
+    // Callers that only care whether a distance beats `bound` use
+    // BoundedDistance. It calls Distance::ComputeBounded when the
+    // functor has one for these arguments, and Distance::Compute
+    // otherwise.
+
+    template <typename Distance, typename VectorType>
+    inline auto BoundedDistanceImpl(const VectorType &a, const VectorType &b,
+                                    double bound, int)
+      -> decltype(Distance::ComputeBounded(a, b, bound)) {
+      return Distance::ComputeBounded(a, b, bound);
+    }
+
+    template <typename Distance, typename VectorType>
+    inline double BoundedDistanceImpl(const VectorType &a, const VectorType &b,
+                                      double, long) {
+      return Distance::Compute(a, b);
+    }
+
+    template <typename Distance, typename VectorType>
+    inline double BoundedDistance(const VectorType &a, const VectorType &b,
+                                  double bound) {
+      return BoundedDistanceImpl<Distance>(a, b, bound, 0);
+    }
     
     // ---------- Array-based Vector Operations ----------
     
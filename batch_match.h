@@ -0,0 +1,113 @@
+#ifndef _ICON_FITTER_BATCH_MATCH_
+#define _ICON_FITTER_BATCH_MATCH_
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "opencv2/imgproc.hpp"
+
+#include "algebra.h"
+#include "feature_image.h"
+#include "hog.h"
+#include "patchmatch.h"
+
+namespace icon_fitter {
+
+  struct BatchMatchOptions {
+    // Source features, which must be built the same way as the
+    // template BlockFeatureImages.
+    HogOptions hog {6, 9, false};
+    int block_size = 3;
+    int stride = 6;
+
+    PatchMatchOptions patchmatch;
+
+    // Templates matched concurrently; 0 uses every core OpenMP
+    // reports. Each individual PatchMatch then runs sequentially.
+    int threads = 0;
+  };
+
+  struct TemplateMatch {
+    // Index into the template list passed to BatchPatchMatch.
+    int template_id = 0;
+    TransformMap transforms {0, 0};
+    // Where the template lands in the frame (see MeanTransform).
+    Transform mean;
+    // Average per-patch distance of the final map.
+    double energy = 0.0;
+  };
+
+  // Matches every template against one shared source. The templates
+  // are handed out largest first to a dynamic schedule, so that the
+  // long matches start early and the short ones fill in the tail.
+  // While they run, all of them read the same source features.
+  template <typename Distance = algebra::L2>
+  std::vector<TemplateMatch> BatchPatchMatch(
+      const std::vector<const BlockFeatureImage<float>*> &templates,
+      const BlockFeatureImage<float> &source,
+      const BatchMatchOptions &options) {
+    int count = static_cast<int>(templates.size());
+    std::vector<int> order(count);
+    for (int k = 0; k < count; ++k) {
+      order[k] = k;
+    }
+    std::sort(order.begin(), order.end(),
+              [&templates](int a, int b) {
+                return templates[a]->height * templates[a]->width >
+                  templates[b]->height * templates[b]->width;
+              });
+
+    PatchMatchOptions patchmatch = options.patchmatch;
+    patchmatch.threads = 1;
+    patchmatch.verbose = false;
+
+    std::vector<TemplateMatch> results(count);
+#ifdef _OPENMP
+    int threads = options.threads > 0 ? options.threads : omp_get_max_threads();
+#else
+    int threads = 1;
+#endif
+#pragma omp parallel for schedule(dynamic, 1) num_threads(threads) if (threads > 1)
+    for (int k = 0; k < count; ++k) {
+      const BlockFeatureImage<float> &target = *templates[order[k]];
+      TemplateMatch &match = results[order[k]];
+      match.template_id = order[k];
+      if (0 == target.height * target.width ||
+          0 == source.height * source.width) {
+        continue;
+      }
+      double energy = 0.0;
+      match.transforms = PatchMatch<float, Distance>(source, target,
+                                                     patchmatch, nullptr,
+                                                     &energy);
+      match.mean = MeanTransform(match.transforms);
+      match.energy = energy / (target.height * target.width);
+    }
+    return results;
+  }
+
+  // Extracts the frame's features once and matches all templates
+  // against them.
+  template <typename Distance = algebra::L2>
+  std::vector<TemplateMatch> BatchPatchMatch(
+      const std::vector<const BlockFeatureImage<float>*> &templates,
+      const cv::Mat &frame,
+      const BatchMatchOptions &options) {
+    for (const BlockFeatureImage<float> *target : templates) {
+      if (target->block_size != options.block_size ||
+          target->stride != options.stride) {
+        printf("[ERROR] template blocks differ from the batch options.\n");
+        exit(-1);
+      }
+    }
+    FeatureImage<float> features = HogGen::Create(frame, options.hog);
+    BlockFeatureImage<float> source(&features, options.block_size,
+                                    options.stride);
+    return BatchPatchMatch<Distance>(templates, source, options);
+  }
+
+}  // namespace icon_fitter
+
+#endif  // _ICON_FITTER_BATCH_MATCH_
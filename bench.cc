@@ -0,0 +1,379 @@
+#include <sys/resource.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "opencv2/highgui.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include "algebra.h"
+#include "feature_image.h"
+#include "hog.h"
+#include "hog_correlation.h"
+#include "patch_index.h"
+#include "patchmatch.h"
+#include "simd_distance.h"
+#include "sparse_match.h"
+#include "template_pyramid.h"
+#include "template_search.h"
+
+using namespace icon_fitter;
+
+// Usage: bench [target] [template] [min seconds per benchmark]
+//
+// Headless, stage by stage timings. Every benchmark repeats its body
+// until at least the minimum time has passed and reports the mean
+// ns/op, the throughput in source megapixels per second (where a
+// source image is involved) and the process peak RSS so far.
+
+namespace {
+
+  // Keeps results observable so the timed work is not optimized away.
+  volatile double sink = 0.0;
+
+  double min_seconds = 0.5;
+
+  double PeakRssMB() {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    // ru_maxrss is in kilobytes on Linux.
+    return usage.ru_maxrss / 1024.0;
+  }
+
+  // Runs body() repeatedly for at least min_seconds and prints one row.
+  // pixels is the number of source pixels one call processes, or 0, and
+  // ops the number of operations one call performs.
+  template <typename Body>
+  void Run(const std::string &name, double pixels, Body body, int ops = 1) {
+    typedef std::chrono::steady_clock Clock;
+    body();  // warm up
+    long iterations = 0;
+    double elapsed = 0.0;
+    auto start = Clock::now();
+    while (elapsed < min_seconds || iterations < 1) {
+      body();
+      ++iterations;
+      elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+    }
+    double ns = elapsed * 1e9 / (static_cast<double>(iterations) * ops);
+    if (pixels > 0.0) {
+      printf("%-36s %10ld %14.0f %10.2f %10.1f\n", name.c_str(), iterations,
+             ns, pixels / (ns * 1e-3), PeakRssMB());
+    } else {
+      printf("%-36s %10ld %14.1f %10s %10.1f\n", name.c_str(), iterations,
+             ns, "-", PeakRssMB());
+    }
+  }
+
+  // Distances between target patches and scattered source patches.
+  template <typename Distance, typename DataType>
+  double DistanceWalk(const BlockFeatureImage<DataType> &target,
+                      const BlockFeatureImage<DataType> &source,
+                      const std::vector<int> &ids) {
+    double sum = 0.0;
+    for (size_t k = 0; k < ids.size(); ++k) {
+      int id = ids[k];
+      sum += Distance::Compute(
+          target.GetPatch(k % target.height, k % target.width),
+          source.GetPatch(id / source.width, id % source.width));
+    }
+    return sum;
+  }
+
+  std::string Resolution(const cv::Mat &image) {
+    return std::to_string(image.cols) + "x" + std::to_string(image.rows);
+  }
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  const char *target_path = argc > 1 ? argv[1] : "targets/cctv_0.jpg";
+  const char *template_path = argc > 2 ? argv[2] : "templates/cctv.png";
+  if (argc > 3) min_seconds = atof(argv[3]);
+
+  cv::Mat target_raw = cv::imread(target_path);
+  cv::Mat template_raw = cv::imread(template_path);
+  if (target_raw.empty() || template_raw.empty()) {
+    printf("Error: failed to read %s or %s\n", target_path, template_path);
+    return -1;
+  }
+
+  HogOptions hog {6, 9, false};
+  const int block_size = 3;
+  const int stride = 6;
+  PatchMatchOptions patchmatch;
+  patchmatch.verbose = false;
+
+  printf("isa: %s\n", algebra::simd::IsaName(algebra::simd::ActiveIsa()));
+  printf("%-36s %10s %14s %10s %10s\n", "benchmark", "iterations", "ns/op",
+         "MPix/s", "peak MB");
+
+  FeatureImage<float> template_features = HogGen::Create(template_raw, hog);
+  BlockFeatureImage<float> target(&template_features, block_size, stride,
+                                  BLOCK_MATERIALIZED);
+  FeatureImage<uint8_t> quantized_template = Quantize(template_features);
+  BlockFeatureImage<uint8_t> quantized_target(&quantized_template, block_size,
+                                              stride, BLOCK_MATERIALIZED);
+  SparsePatchMatchOptions sparse;
+  sparse.solver = patchmatch;
+  SalientPatches salient(target, sparse);
+  const std::vector<const BlockFeatureImage<float>*> library {&target};
+  PatchIndex<algebra::simd::L2> index(library, PatchIndexOptions());
+  Run("patch_index_build", 0.0, [&]() {
+      PatchIndex<algebra::simd::L2> rebuilt(library, PatchIndexOptions());
+      sink = sink + rebuilt.size();
+    });
+
+  // Synthetic resolutions: the target image rescaled to common frame
+  // sizes.
+  const std::vector<cv::Size> resolutions {
+    cv::Size(640, 360), cv::Size(1280, 720), cv::Size(1920, 1080)};
+  for (const cv::Size &resolution : resolutions) {
+    cv::Mat frame;
+    cv::resize(target_raw, frame, resolution, 0, 0, cv::INTER_LINEAR);
+    const std::string suffix = "/" + Resolution(frame);
+    const double pixels = static_cast<double>(frame.rows) * frame.cols;
+
+    // ---------- HOG ----------
+    Run("hog_naive" + suffix, pixels, [&]() {
+        HogOptions options = hog;
+        options.engine = HOG_NAIVE;
+        sink = sink + HogGen::Create(frame, options).size();
+      });
+    Run("hog_integral" + suffix, pixels, [&]() {
+        HogOptions options = hog;
+        options.engine = HOG_INTEGRAL;
+        sink = sink + HogGen::Create(frame, options).size();
+      });
+    {
+      HogOptions options = hog;
+      options.engine = HOG_INTEGRAL;
+      HogWorkspace workspace;
+      FeatureImage<float> reused(0, 0, hog.bins);
+      Run("hog_integral_workspace" + suffix, pixels, [&]() {
+          HogGen::Create(frame, options, &workspace, &reused);
+          sink = sink + reused.size();
+        });
+      options.engine = HOG_FUSED;
+      Run("hog_fused_workspace" + suffix, pixels, [&]() {
+          HogGen::Create(frame, options, &workspace, &reused);
+          sink = sink + reused.size();
+        });
+      options.threads = 4;
+      Run("hog_fused_workspace_4_bands" + suffix, pixels, [&]() {
+          HogGen::Create(frame, options, &workspace, &reused);
+          sink = sink + reused.size();
+        });
+    }
+
+    // ---------- Block Features ----------
+    FeatureImage<float> features = HogGen::Create(frame, hog);
+    Run("block_lazy" + suffix, pixels, [&]() {
+        BlockFeatureImage<float> blocks(&features, block_size, stride);
+        sink = sink + blocks.height;
+      });
+    Run("block_materialized" + suffix, pixels, [&]() {
+        BlockFeatureImage<float> blocks(&features, block_size, stride,
+                                        BLOCK_MATERIALIZED);
+        sink = sink + blocks.height;
+      });
+    {
+      BlockFeatureImage<float> blocks(&features, block_size, stride,
+                                      BLOCK_MATERIALIZED);
+      Run("block_materialized_reset" + suffix, pixels, [&]() {
+          blocks.Reset(&features, block_size, stride, BLOCK_MATERIALIZED);
+          sink = sink + blocks.height;
+        });
+    }
+
+    // ---------- PatchMatch ----------
+    BlockFeatureImage<float> source(&features, block_size, stride);
+    if (0 == source.height * source.width ||
+        0 == target.height * target.width) {
+      continue;
+    }
+    Run("patchmatch" + suffix, pixels, [&]() {
+        TransformMap result = PatchMatch<float, algebra::simd::L2>(
+            source, target, patchmatch);
+        sink = sink + result(0, 0).y;
+      });
+    PatchMatchWorkspace workspace;
+    Run("patchmatch_workspace" + suffix, pixels, [&]() {
+        const TransformMap &result = PatchMatchInto<float, algebra::simd::L2>(
+            source, target, patchmatch, nullptr, &workspace);
+        sink = sink + result.Get(0, 0).y;
+      });
+    Run("patchmatch_sparse" + suffix, pixels, [&]() {
+        SparseMatch match = SparsePatchMatch<float, algebra::simd::L2>(
+            source, target, salient, sparse);
+        sink = sink + match.transform.y;
+      });
+    Run("patch_index_match" + suffix, pixels, [&]() {
+        std::vector<IndexMatch> matches = index.Match(source);
+        sink = sink + matches[0].transform.y;
+      });
+    {
+      FeatureImage<uint8_t> quantized = Quantize(features);
+      BlockFeatureImage<uint8_t> quantized_source(&quantized, block_size,
+                                                  stride, BLOCK_MATERIALIZED);
+      Run("patchmatch_quantized" + suffix, pixels, [&]() {
+          const TransformMap &result =
+            PatchMatchInto<uint8_t, algebra::simd::L2>(
+                quantized_source, quantized_target, patchmatch, nullptr,
+                &workspace);
+          sink = sink + result.Get(0, 0).y;
+        });
+    }
+
+    // ---------- HOG Cross-correlation ----------
+    HogCorrelator correlator(template_features);
+    Run("hog_correlation" + suffix, pixels, [&]() {
+        CorrelationResult result = correlator.Detect(features, 1);
+        sink = sink + result.scores.rows;
+      });
+  }
+
+  // ---------- Distance Kernel ----------
+  {
+    FeatureImage<float> features = HogGen::Create(target_raw, hog);
+    BlockFeatureImage<float> source(&features, block_size, stride);
+    BlockFeatureImage<float> materialized(&features, block_size, stride,
+                                          BLOCK_MATERIALIZED);
+    if (source.height * source.width > 0 &&
+        target.height * target.width > 0) {
+      const int count = 1024;
+      std::vector<int> ids(count);
+      for (int k = 0; k < count; ++k) {
+        ids[k] = (k * 7919) % (source.height * source.width);
+      }
+      Run("distance_scalar_l2", 0.0, [&]() {
+          sink = sink + DistanceWalk<algebra::L2>(target, source, ids);
+        }, count);
+      Run("distance_simd_l2_lazy", 0.0, [&]() {
+          sink = sink + DistanceWalk<algebra::simd::L2>(target, source, ids);
+        }, count);
+      Run("distance_simd_l2_materialized", 0.0, [&]() {
+          sink = sink + DistanceWalk<algebra::simd::L2>(target, materialized,
+                                                        ids);
+        }, count);
+      FeatureImage<uint8_t> quantized = Quantize(features);
+      BlockFeatureImage<uint8_t> quantized_source(&quantized, block_size,
+                                                  stride, BLOCK_MATERIALIZED);
+      Run("distance_simd_l2_quantized", 0.0, [&]() {
+          sink = sink + DistanceWalk<algebra::simd::L2>(quantized_target,
+                                                        quantized_source,
+                                                        ids);
+        }, count);
+    }
+  }
+
+  // ---------- Quantized Accuracy ----------
+  // Float and quantized PatchMatch on every bundled target. The
+  // quantized map is scored with float features so both energies are
+  // on the same scale; the shift is between the mean transforms, in
+  // blocks.
+  {
+    const std::vector<std::string> targets {
+      "targets/cctv_0.jpg", "targets/cctv_10.png", "targets/cctv_13.jpg",
+      "targets/cctv_geo.jpg", "targets/us_tv.png"};
+    printf("\n%-36s %14s %14s %10s %10s\n", "quantized accuracy",
+           "float energy", "quant energy", "ratio", "shift");
+    for (const std::string &path : targets) {
+      cv::Mat frame = cv::imread(path);
+      if (frame.empty()) continue;
+      FeatureImage<float> features = HogGen::Create(frame, hog);
+      FeatureImage<uint8_t> quantized = Quantize(features);
+      BlockFeatureImage<float> source(&features, block_size, stride,
+                                      BLOCK_MATERIALIZED);
+      BlockFeatureImage<uint8_t> quantized_source(&quantized, block_size,
+                                                  stride, BLOCK_MATERIALIZED);
+      if (0 == source.height * source.width ||
+          0 == target.height * target.width) {
+        continue;
+      }
+      TransformMap exact = PatchMatch<float, algebra::simd::L2>(
+          source, target, patchmatch);
+      TransformMap approximate = PatchMatch<uint8_t, algebra::simd::L2>(
+          quantized_source, quantized_target, patchmatch);
+      double exact_energy =
+        GetEnergy<float, algebra::simd::L2>(source, target, exact);
+      double approximate_energy =
+        GetEnergy<float, algebra::simd::L2>(source, target, approximate);
+      Transform a = MeanTransform(exact);
+      Transform b = MeanTransform(approximate);
+      printf("%-36s %14.3f %14.3f %10.3f %10d\n", path.c_str(),
+             exact_energy, approximate_energy,
+             approximate_energy / (exact_energy + algebra::epsilon),
+             std::max(std::abs(a.y - b.y), std::abs(a.x - b.x)));
+    }
+  }
+
+  // ---------- Sparse Accuracy ----------
+  // Dense PatchMatch against the sparse solver on every bundled target:
+  // the shift between the dense mean and the voted transform, in
+  // blocks, and the fraction of the selected patches that voted for
+  // it.
+  {
+    const std::vector<std::string> targets {
+      "targets/cctv_0.jpg", "targets/cctv_10.png", "targets/cctv_13.jpg",
+      "targets/cctv_geo.jpg", "targets/us_tv.png"};
+    printf("\n%-36s %14s %14s %10s %10s\n", "sparse accuracy",
+           "dense", "sparse", "support", "shift");
+    for (const std::string &path : targets) {
+      cv::Mat frame = cv::imread(path);
+      if (frame.empty()) continue;
+      FeatureImage<float> features = HogGen::Create(frame, hog);
+      BlockFeatureImage<float> source(&features, block_size, stride,
+                                      BLOCK_MATERIALIZED);
+      if (0 == source.height * source.width ||
+          0 == target.height * target.width) {
+        continue;
+      }
+      Transform a = MeanTransform(PatchMatch<float, algebra::simd::L2>(
+          source, target, patchmatch));
+      SparseMatch match = SparsePatchMatch<float, algebra::simd::L2>(
+          source, target, salient, sparse);
+      const Transform &b = match.transform;
+      printf("%-36s %7d,%-6d %7d,%-6d %10.3f %10d\n", path.c_str(),
+             a.y, a.x, b.y, b.x,
+             match.support / static_cast<double>(std::max(match.votes, 1)),
+             std::max(std::abs(a.y - b.y), std::abs(a.x - b.x)));
+    }
+  }
+
+  // ---------- cv::matchTemplate ----------
+  {
+    cv::Mat frame;
+    cv::resize(target_raw, frame, resolutions.back(), 0, 0, cv::INTER_LINEAR);
+    const double pixels = static_cast<double>(frame.rows) * frame.cols;
+    // Template layers are Canny edge maps, so the target is matched as
+    // one too (see template_match.cc).
+    cv::Mat edges;
+    cv::cvtColor(frame, edges, cv::COLOR_BGR2GRAY);
+    cv::Canny(edges, edges, 100.0, 300.0, 5);
+    TemplatePyramid templates(template_raw, 0.8);
+    for (int i = 0; i < templates.layers(); ++i) {
+      const cv::Mat &layer = templates.layer(i);
+      if (layer.rows > edges.rows || layer.cols > edges.cols) continue;
+      Run("match_template/level" + std::to_string(i) + "/" +
+          Resolution(layer), pixels, [&]() {
+            cv::Mat result;
+            cv::matchTemplate(edges, layer, result, cv::TM_SQDIFF);
+            sink = sink + result.rows;
+          });
+    }
+
+    // The same layers through the cascaded parallel search.
+    Run("pyramid_search/" + Resolution(frame), pixels, [&]() {
+        TemplateSearchResult result = SearchPyramid(templates, edges,
+                                                    TemplateSearchOptions());
+        sink = sink + result.score;
+      });
+  }
+
+  return 0;
+}
@@ -0,0 +1,308 @@
+#ifndef _ICON_FITTER_FEATURE_CACHE_
+#define _ICON_FITTER_FEATURE_CACHE_
+
+#include <sys/stat.h>
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "opencv2/core.hpp"
+
+#include "feature_image.h"
+#include "hog.h"
+#include "mapped_file.h"
+#include "template_pyramid.h"
+
+namespace icon_fitter {
+
+  // ---------- On-disk Layout ----------
+  // [CacheHeader, padded to DATA_OFFSET bytes][payload]
+  //
+  // FEATURE_IMAGE payload: height * width * depth elements, row major,
+  // exactly as FeatureImage keeps them.
+  //
+  // PYRAMID payload: `layers` LayerRecords followed by every layer's
+  // pixels (rows * cols * elem size, no row padding), each starting on
+  // a DATA_OFFSET boundary.
+  //
+  // Files are written in native byte order and are meant to be read
+  // back on the machine type that produced them.
+
+  struct CacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t kind;
+    // FeatureImage geometry
+    int32_t height;
+    int32_t width;
+    int32_t depth;
+    int32_t element_size;
+    // HogOptions the features were computed with
+    int32_t cell_size;
+    int32_t bins;
+    int32_t signed_orientation;
+    int32_t engine;
+    // Pyramid parameters
+    int32_t layers;
+    int32_t reserved;
+    double shrink_rate;
+  };
+
+  struct LayerRecord {
+    int32_t rows;
+    int32_t cols;
+    int32_t type;
+    int32_t reserved;
+    uint64_t offset;
+  };
+
+  struct FeatureCache {
+    static constexpr uint32_t VERSION = 1;
+    static constexpr size_t DATA_OFFSET = 64;
+
+    enum Kind {
+      FEATURE_IMAGE = 1,
+      PYRAMID = 2,
+    };
+
+    // ---------- Feature Images ----------
+
+    static bool Save(const std::string &path,
+                     const FeatureImage<float> &image,
+                     const HogOptions &options) {
+      CacheHeader header = MakeHeader(FEATURE_IMAGE);
+      header.height = image.height;
+      header.width = image.width;
+      header.depth = image.depth;
+      header.element_size = sizeof(float);
+      header.cell_size = options.cell_size;
+      header.bins = options.bins;
+      header.signed_orientation = options.signed_orientation ? 1 : 0;
+      header.engine = options.engine;
+
+      FILE *file = fopen(path.c_str(), "wb");
+      if (nullptr == file) return false;
+      size_t count = static_cast<size_t>(image.size()) * image.depth;
+      bool ok = WriteHeader(file, header) &&
+        (0 == count || count == fwrite(image.feature(0), sizeof(float),
+                                       count, file));
+      return 0 == fclose(file) && ok;
+    }
+
+    // Maps the cache file and wraps its features in place, without
+    // copying. Returns false when the file is missing, truncated or
+    // corrupt, comes from another format version, or was computed with
+    // different HogOptions. Only the voting engine may differ, since
+    // all engines produce the same features.
+    static bool Load(const std::string &path, const HogOptions &options,
+                     FeatureImage<float> *image) {
+      std::shared_ptr<MappedFile> file = MappedFile::Open(path);
+      const CacheHeader *header = CheckHeader(file, FEATURE_IMAGE);
+      if (nullptr == header ||
+          header->element_size != sizeof(float) ||
+          header->cell_size != options.cell_size ||
+          header->bins != options.bins ||
+          header->depth != options.bins ||
+          header->signed_orientation != (options.signed_orientation ? 1 : 0)) {
+        return false;
+      }
+      uint64_t bytes = 0;
+      if (!Extent(header->height, header->width, header->depth,
+                  sizeof(float), &bytes) ||
+          !Inside(*file, DATA_OFFSET, bytes)) {
+        return false;
+      }
+      float *data = reinterpret_cast<float*>(file->data() + DATA_OFFSET);
+      *image = FeatureImage<float>(header->height, header->width,
+                                   header->depth, data, file);
+      return true;
+    }
+
+    // HOG of the image at image_path, taken from cache_path when that
+    // is valid and not older than the image, and computed (then
+    // written to cache_path) otherwise.
+    static FeatureImage<float> LoadOrCreate(const std::string &image_path,
+                                            const std::string &cache_path,
+                                            const HogOptions &options) {
+      FeatureImage<float> image(0, 0, 0);
+      if (IsFresh(cache_path, image_path) &&
+          Load(cache_path, options, &image)) {
+        return image;
+      }
+      image = HogGen::Create(image_path, options);
+      if (!Save(cache_path, image, options)) {
+        printf("Warning: failed to write feature cache %s\n",
+               cache_path.c_str());
+      }
+      return image;
+    }
+
+    // ---------- Template Pyramids ----------
+
+    static bool SavePyramid(const std::string &path,
+                            const TemplatePyramid &pyramid,
+                            double shrink_rate) {
+      CacheHeader header = MakeHeader(PYRAMID);
+      header.layers = pyramid.layers();
+      header.shrink_rate = shrink_rate;
+
+      std::vector<LayerRecord> records(pyramid.layers());
+      uint64_t offset = Align(DATA_OFFSET +
+                              records.size() * sizeof(LayerRecord));
+      for (int i = 0; i < pyramid.layers(); ++i) {
+        const cv::Mat &layer = pyramid.layer(i);
+        records[i].rows = layer.rows;
+        records[i].cols = layer.cols;
+        records[i].type = layer.type();
+        records[i].reserved = 0;
+        records[i].offset = offset;
+        offset = Align(offset + LayerBytes(records[i]));
+      }
+
+      FILE *file = fopen(path.c_str(), "wb");
+      if (nullptr == file) return false;
+      bool ok = WriteHeader(file, header) &&
+        (records.empty() ||
+         records.size() == fwrite(&records[0], sizeof(LayerRecord),
+                                  records.size(), file));
+      for (int i = 0; ok && i < pyramid.layers(); ++i) {
+        const cv::Mat &layer = pyramid.layer(i);
+        ok = Pad(file, records[i].offset);
+        size_t row_bytes = layer.cols * layer.elemSize();
+        for (int r = 0; ok && r < layer.rows; ++r) {
+          ok = row_bytes == fwrite(layer.ptr(r), 1, row_bytes, file);
+        }
+      }
+      return 0 == fclose(file) && ok;
+    }
+
+    // Maps the cache file and builds the pyramid from cv::Mat headers
+    // that point straight into the mapping. Returns false when the file
+    // is missing, truncated or corrupt, or the shrink rate differs.
+    static bool LoadPyramid(const std::string &path, double shrink_rate,
+                            TemplatePyramid *pyramid) {
+      std::shared_ptr<MappedFile> file = MappedFile::Open(path);
+      const CacheHeader *header = CheckHeader(file, PYRAMID);
+      if (nullptr == header || header->shrink_rate != shrink_rate ||
+          header->layers < 0 ||
+          !Inside(*file, DATA_OFFSET,
+                  header->layers * sizeof(LayerRecord))) {
+        return false;
+      }
+      const LayerRecord *records = reinterpret_cast<const LayerRecord*>(
+          file->data() + DATA_OFFSET);
+      std::vector<cv::Mat> layers;
+      for (int i = 0; i < header->layers; ++i) {
+        uint64_t bytes = 0;
+        if (records[i].type != CV_MAT_TYPE(records[i].type) ||
+            !Extent(records[i].rows, records[i].cols, 1,
+                    CV_ELEM_SIZE(records[i].type), &bytes) ||
+            !Inside(*file, records[i].offset, bytes)) {
+          return false;
+        }
+        layers.emplace_back(records[i].rows, records[i].cols,
+                            records[i].type,
+                            file->data() + records[i].offset);
+      }
+      *pyramid = TemplatePyramid(std::move(layers), file);
+      return true;
+    }
+
+    // True when cache_path exists and is at least as new as source_path.
+    static bool IsFresh(const std::string &cache_path,
+                        const std::string &source_path) {
+      struct stat cache;
+      struct stat source;
+      if (0 != stat(cache_path.c_str(), &cache)) return false;
+      if (0 != stat(source_path.c_str(), &source)) return true;
+      return cache.st_mtime >= source.st_mtime;
+    }
+
+  private:
+    static CacheHeader MakeHeader(Kind kind) {
+      CacheHeader header;
+      memset(&header, 0, sizeof(header));
+      memcpy(header.magic, "ICONFITC", sizeof(header.magic));
+      header.version = VERSION;
+      header.kind = kind;
+      return header;
+    }
+
+    static const CacheHeader *CheckHeader(
+        const std::shared_ptr<MappedFile> &file, Kind kind) {
+      if (nullptr == file || file->size() < DATA_OFFSET) return nullptr;
+      const CacheHeader *header =
+        reinterpret_cast<const CacheHeader*>(file->data());
+      if (0 != memcmp(header->magic, "ICONFITC", sizeof(header->magic)) ||
+          VERSION != header->version ||
+          static_cast<uint32_t>(kind) != header->kind) {
+        return nullptr;
+      }
+      return header;
+    }
+
+    static bool WriteHeader(FILE *file, const CacheHeader &header) {
+      char block[DATA_OFFSET];
+      memset(block, 0, sizeof(block));
+      memcpy(block, &header, sizeof(header));
+      return 1 == fwrite(block, sizeof(block), 1, file);
+    }
+
+    // Zero fills up to the absolute file position `offset`.
+    static bool Pad(FILE *file, uint64_t offset) {
+      long position = ftell(file);
+      if (position < 0 || static_cast<uint64_t>(position) > offset) {
+        return false;
+      }
+      for (uint64_t k = position; k < offset; ++k) {
+        if (EOF == fputc(0, file)) return false;
+      }
+      return true;
+    }
+
+    static uint64_t Align(uint64_t offset) {
+      return (offset + DATA_OFFSET - 1) / DATA_OFFSET * DATA_OFFSET;
+    }
+
+    // Sets *bytes to the size of a height x width x depth array of
+    // element_size byte elements. False when a dimension is not
+    // positive, or the array is too large to index with an int or to
+    // size in 64 bits, as only a corrupt header would have it.
+    static bool Extent(int64_t height, int64_t width, int64_t depth,
+                       int64_t element_size, uint64_t *bytes) {
+      const int64_t limit = std::numeric_limits<int>::max();
+      if (height <= 0 || width <= 0 || depth <= 0 || element_size <= 0 ||
+          height > limit / width || height * width > limit / depth) {
+        return false;
+      }
+      int64_t elements = height * width * depth;
+      if (elements > std::numeric_limits<int64_t>::max() / element_size) {
+        return false;
+      }
+      *bytes = static_cast<uint64_t>(elements * element_size);
+      return true;
+    }
+
+    // Whether bytes bytes from offset lie inside the file.
+    static bool Inside(const MappedFile &file, uint64_t offset,
+                       uint64_t bytes) {
+      return offset <= file.size() && bytes <= file.size() - offset;
+    }
+
+    static uint64_t LayerBytes(const LayerRecord &record) {
+      return static_cast<uint64_t>(record.rows) * record.cols *
+        CV_ELEM_SIZE(record.type);
+    }
+
+    static_assert(sizeof(CacheHeader) <= DATA_OFFSET,
+                  "CacheHeader must fit in the header block.");
+  };
+
+}  // namespace icon_fitter
+
+#endif  // _ICON_FITTER_FEATURE_CACHE_
@@ -1,6 +1,12 @@
 #ifndef _ICON_FITTER_FEATURE_IMAGE_
 #define _ICON_FITTER_FEATURE_IMAGE_
 
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <random>
 #include <vector>
 
 #include "algebra.h"
@@ -17,13 +23,24 @@ namespace icon_fitter {
 
     FeatureImage(int height_, int width_, int depth_)
       : height(height_), width(width_), depth(depth_),
-        data_(height * width * depth, 0.0) {}
+        data_(height * width * depth, 0.0), base_(data_.data()) {}
+
+    // Wraps height * width * depth elements that live elsewhere (for
+    // instance in a memory mapped cache file) without copying them.
+    // owner is kept alive for as long as the image is.
+    FeatureImage(int height_, int width_, int depth_,
+                 DataType *external, std::shared_ptr<void> owner)
+      : height(height_), width(width_), depth(depth_),
+        base_(external), owner_(std::move(owner)) {}
 
     FeatureImage(FeatureImage &&other) {
       width = other.width;
       height = other.height;
       depth = other.depth;
       data_ = std::move(other.data_);
+      base_ = other.base_;
+      owner_ = std::move(other.owner_);
+      other.base_ = nullptr;
     }
 
     const FeatureImage &operator=(FeatureImage &&other) {
@@ -31,28 +48,49 @@ namespace icon_fitter {
       height = other.height;
       depth = other.depth;
       data_ = std::move(other.data_);
+      base_ = other.base_;
+      owner_ = std::move(other.owner_);
+      other.base_ = nullptr;
+      return *this;
     }
     
     inline const DataType *feature(int y, int x) const {
-      return &data_[(y * width + x) * depth];
+      return base_ + (y * width + x) * depth;
     }
 
     inline const DataType *feature(int id) const {
-      return &data_[id * depth];
+      return base_ + id * depth;
     }
 
     inline DataType *mutable_feature(int y, int x) {
-      return &data_[(y * width + x) * depth];
+      return base_ + (y * width + x) * depth;
     }
 
     inline DataType *mutable_feature(int id) {
-      return &data_[id * depth];
+      return base_ + id * depth;
     }
 
     inline int size() const {
       return width * height;
     }
 
+    // Makes this an owning image of the given shape, zeroed unless the
+    // caller is about to overwrite every element anyway. The storage
+    // is reused when it is large enough, so a frame loop at a fixed
+    // resolution does not allocate.
+    void Reshape(int height_, int width_, int depth_, bool zero = true) {
+      height = height_;
+      width = width_;
+      depth = depth_;
+      if (zero) {
+        data_.assign(height * width * depth, 0.0);
+      } else {
+        data_.resize(height * width * depth);
+      }
+      base_ = data_.data();
+      owner_.reset();
+    }
+
     inline void Normalize() {
       for (int i = 0; i < height * width; ++i) {
         algebra::Normalize(mutable_feature(i), depth);
@@ -61,11 +99,128 @@ namespace icon_fitter {
 
   private:
     std::vector<DataType> data_;
+    // Either data_.data() or borrowed storage held alive by owner_.
+    DataType *base_;
+    std::shared_ptr<void> owner_;
+  };
+
+
+  // ---------- Fixed Configuration ----------
+  // Deployments run HogOptions {6, 9, false} with 3 x 3 blocks of
+  // stride 6 (see test.cc), an 81 element descriptor. The hot loops
+  // of HOG, blocks and distances are templates in which 0 stands for
+  // "read the parameter at run time"; their entry points instantiate
+  // them with these constants whenever the parameters match, so the
+  // deployed configuration runs fully unrolled code and everything
+  // else the generic loops.
+  constexpr int kFixedCellSize = 6;
+  constexpr int kFixedBins = 9;
+  constexpr int kFixedBlockSize = 3;
+  constexpr int kFixedStride = 6;
+
+  // The materialized patch size of the fixed configuration, for
+  // elements of the given size (see BlockFeatureImage).
+  constexpr int FixedPaddedDimension(int element_size) {
+    return (kFixedBlockSize * kFixedBlockSize * kFixedBins +
+            32 / element_size - 1) / (32 / element_size) * (32 / element_size);
+  }
+
+
+  // ---------- Regions of Interest ----------
+  // Broadcast logos sit in a few fixed places, usually the corners, so
+  // HOG, blocks and PatchMatch can be restricted to a list of regions.
+  // An empty list always means the whole image.
+
+  // Rectangle of feature (pixel) positions.
+  struct Region {
+    int y;
+    int x;
+    int height;
+    int width;
+  };
+
+  // A list of regions rasterized over a height x width grid, for
+  // constant time membership tests and sampling.
+  class RegionMask {
+  public:
+    // Each region loses shrink rows at the bottom and shrink columns
+    // on the right before it is clipped to the grid, which turns
+    // regions of features into the blocks that lie entirely inside
+    // them.
+    void Reset(int height, int width, const std::vector<Region> &regions,
+               int shrink = 0) {
+      height_ = height;
+      width_ = width;
+      boxes_.clear();
+      cumulative_.clear();
+      inside_.assign(height * width, 0);
+      area_ = 0;
+      for (const Region &region : regions) {
+        int y0 = std::max(region.y, 0);
+        int x0 = std::max(region.x, 0);
+        int y1 = std::min(region.y + region.height - shrink, height);
+        int x1 = std::min(region.x + region.width - shrink, width);
+        if (y1 <= y0 || x1 <= x0) continue;
+        boxes_.push_back(Region {y0, x0, y1 - y0, x1 - x0});
+        area_ += (y1 - y0) * (x1 - x0);
+        cumulative_.push_back(area_);
+        for (int y = y0; y < y1; ++y) {
+          memset(&inside_[y * width + x0], 1, x1 - x0);
+        }
+      }
+    }
+
+    inline bool Contains(int y, int x) const {
+      return 0 != inside_[y * width_ + x];
+    }
+
+    // The clipped regions, and their total area. Overlaps count once
+    // per region.
+    const std::vector<Region> &boxes() const {
+      return boxes_;
+    }
+
+    int area() const {
+      return area_;
+    }
+
+    // A position drawn uniformly from the regions (positions where
+    // regions overlap are proportionally more likely). area() must be
+    // positive.
+    template <typename Generator>
+    inline void Sample(Generator &generator, int *y, int *x) const {
+      std::uniform_int_distribution<int> position(0, area_ - 1);
+      int k = position(generator);
+      int box = 0;
+      while (k >= cumulative_[box]) ++box;
+      const Region &region = boxes_[box];
+      k -= cumulative_[box] - region.height * region.width;
+      *y = region.y + k / region.width;
+      *x = region.x + k % region.width;
+    }
+
+  private:
+    int height_ = 0;
+    int width_ = 0;
+    int area_ = 0;
+    std::vector<Region> boxes_;
+    std::vector<int> cumulative_;
+    std::vector<uint8_t> inside_;
   };
 
 
   // ---------- Blocked Featuer Image ----------
 
+  enum BlockStorage {
+    // Patches point into the parent FeatureImage and gather their
+    // elements through an offset table. No extra memory.
+    BLOCK_LAZY = 0,
+    // Every patch is copied into its own aligned, zero padded,
+    // contiguous vector. Costs padded_dimension elements per location
+    // but makes each patch a single linear read.
+    BLOCK_MATERIALIZED,
+  };
+
   template <typename DataType>
   struct BlockFeatureImage;
 
@@ -75,8 +230,10 @@ namespace icon_fitter {
     
   public:
     Patch(const BlockFeatureImage<DataType> *parent,
-          const DataType *begin) 
-      : parent_(parent), begin_(begin) {}
+          const DataType *begin,
+          float sum = 0.0f, float norm = 0.0f) 
+      : parent_(parent), begin_(begin), sum_(sum),
+        norm_(norm) {}
 
     Patch(const Patch<DataType> &other) = default;
 
@@ -87,10 +244,54 @@ namespace icon_fitter {
     inline int size() const {
       return parent_->dimension;
     }
+
+    // The patch is runs() contiguous runs of run_length() elements,
+    // the k-th one starting at begin() + run_offsets()[k].
+    inline const DataType *begin() const {
+      return begin_;
+    }
+
+    inline int runs() const {
+      return static_cast<int>(parent_->run_offsets_.size());
+    }
+
+    inline int run_length() const {
+      return parent_->run_length_;
+    }
+
+    inline const int *run_offsets() const {
+      return &parent_->run_offsets_[0];
+    }
+
+    // Materialized patches are plain arrays of padded_size() elements
+    // (zeros past size()) starting at data().
+    inline bool contiguous() const {
+      return BLOCK_MATERIALIZED == parent_->storage;
+    }
+
+    inline const DataType *data() const {
+      return begin_;
+    }
+
+    inline int padded_size() const {
+      return parent_->padded_dimension;
+    }
+
+    // Sum and L2 norm of the elements, precomputed so that
+    // distances can be bounded from below without reading the patch.
+    inline float sum() const {
+      return sum_;
+    }
+
+    inline float norm() const {
+      return norm_;
+    }
     
   private:
     const BlockFeatureImage<DataType> *parent_;
     const DataType *begin_;
+    float sum_;
+    float norm_;
   };
     
 
@@ -104,34 +305,68 @@ namespace icon_fitter {
     int dimension;
     int width;
     int height;
+    BlockStorage storage;
+    // dimension rounded up to a whole number of 32-byte vectors. Equal
+    // to dimension for BLOCK_LAZY.
+    int padded_dimension;
 
+    // A materialized image no longer reads from image once
+    // constructed, so image may be released afterwards.
+    //
+    // With regions (of feature positions), only the blocks lying
+    // entirely inside one of them are valid (see regions()). The
+    // others still have a patch, but its contents are unspecified and
+    // it is neither summarized nor materialized.
     BlockFeatureImage(const FeatureImage<DataType> *image, 
                       int block_size_, 
-                      int stride_) 
-      : block_size(block_size_), stride(stride_), image_(image) {
+                      int stride_,
+                      BlockStorage storage_ = BLOCK_LAZY,
+                      const std::vector<Region> *regions = nullptr) {
+      Reset(image, block_size_, stride_, storage_, regions);
+    }
+
+    // Rebuilds the blocks over another image, or the same one after
+    // its contents changed. Every buffer keeps its capacity, so in a
+    // frame loop at a fixed resolution this does not allocate.
+    void Reset(const FeatureImage<DataType> *image, 
+               int block_size_, 
+               int stride_,
+               BlockStorage storage_ = BLOCK_LAZY,
+               const std::vector<Region> *regions = nullptr) {
+      block_size = block_size_;
+      stride = stride_;
+      storage = storage_;
+      image_ = image;
+      run_length_ = image->depth;
       dimension = block_size * block_size * image->depth;
+      padded_dimension = dimension;
       height = image->height - (block_size - 1) * stride;
       if (height < 0) height = 0;
       width = image->width - (block_size - 1) * stride;
       if (width < 0) width = 0;
+      masked_ = nullptr != regions && !regions->empty();
+      if (masked_) {
+        mask_.Reset(height, width, *regions, (block_size - 1) * stride);
+      }
 
       offsets_.resize(dimension);
+      run_offsets_.resize(block_size * block_size);
       int id = 0;
       for (int i = 0; i < block_size; ++i) {
         for (int j = 0; j < block_size; ++j) {
           int base = (i * stride * image->width + j * stride) * image->depth;
+          run_offsets_[i * block_size + j] = base;
           for (int k = 0; k < image->depth; ++k) {
             offsets_[id++] = (base++);
           }
         }
       }
       
-      // Create patches
-      patches_.reserve(height * width);
-      for (int i = 0; i < height; ++i) {
-        for (int j = 0; j < width; ++j) {
-          patches_.emplace_back(this, image_->feature(i, j));
-        }
+      if (kFixedBlockSize == block_size && kFixedStride == stride &&
+          kFixedBins == image->depth) {
+        Build<kFixedBlockSize, kFixedStride, kFixedBins>();
+      } else {
+        Build<0, 0, 0>();
       }
     }
     
@@ -143,12 +378,203 @@ namespace icon_fitter {
       return patches_[id];
     }
 
+    // The valid block positions, or nullptr when all of them are.
+    inline const RegionMask *regions() const {
+      return masked_ ? &mask_ : nullptr;
+    }
+
   private:
+    static constexpr int kAlignment = 32;
+
+    // Summarizes and creates the patches. Non-zero template arguments
+    // replace block_size, stride and the image depth (see Fixed
+    // Configuration).
+    template <int kBlockSize, int kStride, int kDepth>
+    void Build() {
+      Summarize<kBlockSize, kStride, kDepth>();
+      
+      patches_.clear();
+      if (BLOCK_MATERIALIZED == storage) {
+        Materialize<kBlockSize, kDepth>();
+        return;
+      }
+      
+      // Create patches
+      patches_.reserve(height * width);
+      for (int i = 0; i < height; ++i) {
+        for (int j = 0; j < width; ++j) {
+          int id = i * width + j;
+          patches_.emplace_back(this, image_->feature(i, j), sums_[id],
+                                norms_[id]);
+        }
+      }
+    }
+
+    // Per patch sums and norms, assembled from the per-cell sums and
+    // squared norms so each cell is read once rather than once per
+    // patch covering it.
+    template <int kBlockSize, int kStride, int kDepth>
+    void Summarize() {
+      const int block = kBlockSize > 0 ? kBlockSize : block_size;
+      const int step = kStride > 0 ? kStride : stride;
+      const int cells = image_->size();
+      cell_sums_.resize(cells);
+      cell_squares_.resize(cells);
+      if (masked_) {
+        // Only the cells under valid blocks.
+        const int extent = (block - 1) * step;
+        for (const Region &box : mask_.boxes()) {
+          for (int y = box.y; y < box.y + box.height + extent; ++y) {
+            for (int x = box.x; x < box.x + box.width + extent; ++x) {
+              SummarizeCell<kDepth>(y * image_->width + x);
+            }
+          }
+        }
+      } else {
+        for (int c = 0; c < cells; ++c) {
+          SummarizeCell<kDepth>(c);
+        }
+      }
+
+      sums_.assign(height * width, 0.0f);
+      norms_.assign(height * width, 0.0f);
+      for (int i = 0; i < height; ++i) {
+        for (int j = 0; j < width; ++j) {
+          if (masked_ && !mask_.Contains(i, j)) continue;
+          int id = i * width + j;
+          float sum = 0.0f;
+          float square = 0.0f;
+          for (int bi = 0; bi < block; ++bi) {
+            int row = (i + bi * step) * image_->width + j;
+            for (int bj = 0; bj < block; ++bj) {
+              sum += cell_sums_[row + bj * step];
+              square += cell_squares_[row + bj * step];
+            }
+          }
+          sums_[id] = sum;
+          norms_[id] = sqrt(square);
+        }
+      }
+    }
+
+    // Copies every patch into unrolled_, after which the offset tables
+    // describe the contiguous layout instead of the parent image.
+    template <int kBlockSize, int kDepth>
+    void Materialize() {
+      const int runs = kBlockSize > 0 ? kBlockSize * kBlockSize :
+        static_cast<int>(run_offsets_.size());
+      const int run_length = kDepth > 0 ? kDepth : run_length_;
+      int lanes = kAlignment / sizeof(DataType);
+      if (lanes < 1) lanes = 1;
+      padded_dimension = (dimension + lanes - 1) / lanes * lanes;
+
+      // Invalid blocks all share one zero patch, stored first.
+      int count = height * width;
+      if (masked_) {
+        count = 1;
+        for (int id = 0; id < height * width; ++id) {
+          if (mask_.Contains(id / width, id % width)) ++count;
+        }
+      }
+      unrolled_.assign(count * padded_dimension + lanes, 0);
+      uintptr_t address = reinterpret_cast<uintptr_t>(&unrolled_[0]);
+      uintptr_t aligned = (address + kAlignment - 1) & 
+        ~static_cast<uintptr_t>(kAlignment - 1);
+      DataType *base = &unrolled_[0] + (aligned - address) / sizeof(DataType);
+      const DataType *zero = base;
+      if (masked_) base += padded_dimension;
+
+      patches_.reserve(height * width);
+      for (int i = 0; i < height; ++i) {
+        for (int j = 0; j < width; ++j) {
+          if (masked_ && !mask_.Contains(i, j)) {
+            patches_.emplace_back(this, zero);
+            continue;
+          }
+          DataType *destination = base;
+          const DataType *source = image_->feature(i, j);
+          for (int r = 0; r < runs; ++r) {
+            algebra::CopyVector(source + run_offsets_[r], destination,
+                                run_length);
+            destination += run_length;
+          }
+          int id = i * width + j;
+          patches_.emplace_back(this, base, sums_[id], norms_[id]);
+          base += padded_dimension;
+        }
+      }
+
+      for (int k = 0; k < dimension; ++k) {
+        offsets_[k] = k;
+      }
+      for (int r = 0; r < static_cast<int>(run_offsets_.size()); ++r) {
+        run_offsets_[r] = r * run_length_;
+      }
+      image_ = nullptr;
+    }
+
+    // Sums and squared norms of one cell of image_.
+    template <int kDepth>
+    inline void SummarizeCell(int c) {
+      const int depth = kDepth > 0 ? kDepth : image_->depth;
+      const DataType *feature = image_->feature(c);
+      float sum = 0.0f;
+      float square = 0.0f;
+      for (int k = 0; k < depth; ++k) {
+        sum += feature[k];
+        square += feature[k] * feature[k];
+      }
+      cell_sums_[c] = sum;
+      cell_squares_[c] = square;
+    }
+
     const FeatureImage<DataType> *image_;
+    bool masked_;
+    RegionMask mask_;
+    int run_length_;
     std::vector<int> offsets_;
+    std::vector<int> run_offsets_;
     std::vector<Patch<DataType> > patches_;
+    std::vector<DataType> unrolled_;
+    // Summarize scratch, kept for reuse by Reset.
+    std::vector<float> cell_sums_;
+    std::vector<float> cell_squares_;
+    std::vector<float> sums_;
+    std::vector<float> norms_;
   };
 
+
+  // ---------- Quantized Features ----------
+  // HOG histograms are L2 normalized per cell, so every entry lies in
+  // [0, 1] and fits in a byte as round(v * kQuantizationScale). Block
+  // images and PatchMatch work on FeatureImage<uint8_t> unchanged, at a
+  // quarter of the memory. Distances come out in quantized units; an
+  // L2 distance divided by kQuantizationScale^2 is back on the float
+  // scale.
+
+  constexpr float kQuantizationScale = 255.0f;
+
+  // Reuses result's storage, like FeatureImage::Reshape.
+  inline void Quantize(const FeatureImage<float> &image,
+                       FeatureImage<uint8_t> *result) {
+    result->Reshape(image.height, image.width, image.depth, false);
+    const int count = image.size() * image.depth;
+    const float *source = image.feature(0);
+    uint8_t *destination = result->mutable_feature(0);
+    for (int k = 0; k < count; ++k) {
+      float level = source[k] * kQuantizationScale + 0.5f;
+      level = level < 0.0f ? 0.0f : level;
+      level = level > kQuantizationScale ? kQuantizationScale : level;
+      destination[k] = static_cast<uint8_t>(level);
+    }
+  }
+
+  inline FeatureImage<uint8_t> Quantize(const FeatureImage<float> &image) {
+    FeatureImage<uint8_t> result(0, 0, image.depth);
+    Quantize(image, &result);
+    return result;
+  }
+
 }  // namespace icon_fitter
 
 
@@ -1,36 +1,62 @@
 #ifndef _ICON_FITTER_HOG_
 #define _ICON_FITTER_HOG_
 
+#include <algorithm>
 #include <cstdio>
 #include <cmath>
+#include <cstring>
 #include <utility>
+#include <vector>
 
 #define _USE_MATH_DEFINES
 
 #include "opencv2/imgproc.hpp"
 #include "opencv2/highgui.hpp"
 
+#include "algebra.h"
 #include "feature_image.h"
 
 namespace icon_fitter {
 
+  enum HogEngine {
+    // Every pixel votes into each of the cell_size x cell_size cells
+    // covering it, O(W * H * cell_size^2).
+    HOG_NAIVE = 0,
+    // Votes are scattered once and then tent-filtered per bin with
+    // running prefix sums, O(W * H * bins) regardless of cell_size.
+    HOG_INTEGRAL,
+    // Preprocessing and voting fused. 8-bit input is streamed row by
+    // row from BGR to normalized cells, with a few rows of scratch
+    // instead of full size intermediate images, binned without atan2
+    // and filtered with direct taps, O(W * H * bins * cell_size). Other
+    // input falls back to HOG_INTEGRAL.
+    HOG_FUSED,
+  };
+
   struct HogOptions {
     // Cell parameters
     int cell_size;
     // Feature parameters
     int bins;
     bool signed_orientation;
+    // Voting backend, HOG_NAIVE when omitted from the initializer.
+    HogEngine engine;
+    // HOG_FUSED splits the rows into this many bands, each handled by
+    // its own thread. 0 (when omitted) and 1 run a single band.
+    int threads;
   };
 
   struct OrientationBucketer {
     double bin_size;
     bool is_signed;
+    int bins;
 
     OrientationBucketer(const HogOptions &options) 
       : bin_size(options.signed_orientation ? 
                  M_PI * 2 / options.bins :
                  M_PI / options.bins),
-        is_signed(options.signed_orientation) {}
+        is_signed(options.signed_orientation),
+        bins(options.bins) {}
       
     inline std::pair<int, double> operator()(double y, double x) {
       double position;
@@ -44,8 +70,10 @@ namespace icon_fitter {
           position = angle;
         }
       }
-      return std::make_pair(static_cast<int>(position / bin_size),
-                            Magnitude(y, x));
+      // atan2 may return exactly pi, which wraps around to bin 0.
+      int bin = static_cast<int>(position / bin_size);
+      if (bin >= bins) bin -= bins;
+      return std::make_pair(bin, Magnitude(y, x));
     }
       
   private:
@@ -54,12 +82,165 @@ namespace icon_fitter {
     }
   };
 
+  // The bins of OrientationBucketer for a whole row of gradients,
+  // without atan2. The bin of a gradient is the number of bin
+  // boundaries its angle has passed, and whether it has passed
+  // boundary k is the sign of its projection onto the normal of that
+  // boundary. It agrees with OrientationBucketer except for angles
+  // within float rounding of a boundary.
+  struct OrientationProjector {
+    int bins = 0;
+    bool is_signed = false;
+    // Boundary k + 1 is at the angle whose cosine and sine these are.
+    std::vector<float> cosines;
+    std::vector<float> sines;
+    // Signed only: whether boundary k + 1 lies in [0, pi].
+    std::vector<int> first_half;
+
+    // Recomputes the boundaries when options changed them.
+    void Reset(const HogOptions &options) {
+      if (bins == options.bins && is_signed == options.signed_orientation) {
+        return;
+      }
+      bins = options.bins;
+      is_signed = options.signed_orientation;
+      double bin_size = is_signed ? M_PI * 2 / bins : M_PI / bins;
+      cosines.resize(bins - 1);
+      sines.resize(bins - 1);
+      first_half.resize(bins - 1);
+      for (int k = 1; k < bins; ++k) {
+        cosines[k - 1] = static_cast<float>(cos(k * bin_size));
+        sines[k - 1] = static_cast<float>(sin(k * bin_size));
+        first_half[k - 1] = 2 * k <= bins;
+      }
+    }
+
+    // Bins of count gradients (gx, gy), which are overwritten. Every
+    // loop runs over the row, so they all vectorize. A non-zero kBins
+    // must equal bins and fixes the number of boundary passes.
+    template <int kBins = 0>
+    void operator()(float *gx, float *gy, int count, int *bin) const {
+      const int bins = kBins > 0 ? kBins : this->bins;
+      for (int j = 0; j < count; ++j) {
+        bin[j] = 0;
+      }
+      if (!is_signed) {
+        // Fold [pi, 2 pi) onto [0, pi), and count boundaries there.
+        for (int j = 0; j < count; ++j) {
+          float flip = gy[j] < 0.0f ? -1.0f : 1.0f;
+          gx[j] *= flip;
+          gy[j] *= flip;
+        }
+        for (int k = 0; k < bins - 1; ++k) {
+          const float c = cosines[k];
+          const float s = sines[k];
+          for (int j = 0; j < count; ++j) {
+            bin[j] += c * gy[j] - s * gx[j] >= 0.0f ? 1 : 0;
+          }
+        }
+        // Horizontal gradients are at 0 or pi, both of which are bin 0.
+        for (int j = 0; j < count; ++j) {
+          if (0.0f == gy[j]) bin[j] = 0;
+        }
+        return;
+      }
+      // OrientationBucketer measures the angle of (-gx, -gy) in
+      // [0, 2 pi). Past pi, every boundary in [0, pi] counts and the
+      // rest are tested as usual.
+      for (int j = 0; j < count; ++j) {
+        gx[j] = -gx[j];
+        gy[j] = -gy[j];
+      }
+      for (int k = 0; k < bins - 1; ++k) {
+        const float c = cosines[k];
+        const float s = sines[k];
+        if (first_half[k]) {
+          for (int j = 0; j < count; ++j) {
+            bool past_pi = gy[j] < 0.0f || (0.0f == gy[j] && gx[j] < 0.0f);
+            bin[j] += past_pi || c * gy[j] - s * gx[j] >= 0.0f ? 1 : 0;
+          }
+        } else {
+          for (int j = 0; j < count; ++j) {
+            bool past_pi = gy[j] < 0.0f || (0.0f == gy[j] && gx[j] < 0.0f);
+            bin[j] += past_pi && c * gy[j] - s * gx[j] >= 0.0f ? 1 : 0;
+          }
+        }
+      }
+    }
+  };
+
+  // Row scratch of one HOG_FUSED band.
+  struct HogBand {
+    // Ring of 3 normalized gray rows, and the image row in each slot.
+    std::vector<float> gray;
+    int gray_rows[3];
+    // Vertically smoothed rows and vertical differences, with one
+    // element of border on either side.
+    std::vector<float> smoothed;
+    std::vector<float> difference;
+    std::vector<float> gx;
+    std::vector<float> gy;
+    std::vector<float> magnitude;
+    std::vector<int> bin;
+    // Tent weights w(0) .. w(cell_size - 1).
+    std::vector<float> taps;
+    // Ring of cell_size rows of votes filtered along the row.
+    std::vector<float> filtered;
+  };
+
+
+  // The lowest and highest gray level of an 8-bit image, which min-max
+  // normalization maps to 0 and 255 (see HogGen::FindGrayRange).
+  struct GrayRange {
+    int low;
+    int high;
 
+    void Merge(const GrayRange &other) {
+      low = std::min(low, other.low);
+      high = std::max(high, other.high);
+    }
+  };
+
+  // Intermediate images and buffers of HogGen::Create. A frame loop
+  // that passes the same workspace (and result) for every frame stops
+  // allocating once the first frame has sized them.
+  struct HogWorkspace {
+    cv::Mat processed;
+    cv::Mat gradx;
+    cv::Mat grady;
+    // HOG_INTEGRAL prefix sums, along rows (s0, s1) and columns (p0, p1).
+    std::vector<double> s0;
+    std::vector<double> s1;
+    std::vector<double> p0;
+    std::vector<double> p1;
+    // HOG_FUSED state.
+    OrientationProjector projector;
+    std::vector<HogBand> bands;
+    // Features of the current region, for the region overload.
+    FeatureImage<float> region {0, 0, 0};
+  };
    
   struct HogGen {
     static FeatureImage<float> Create(const cv::Mat &input,
                                       HogOptions options) {
-      cv::Mat processed;
+      HogWorkspace workspace;
+      FeatureImage<float> result(0, 0, options.bins);
+      Create(input, options, &workspace, &result);
+      return result;
+    }
+
+    // Same as above, but builds the features into *result, reusing its
+    // storage and the buffers in *workspace.
+    static void Create(const cv::Mat &input, HogOptions options,
+                       HogWorkspace *workspace,
+                       FeatureImage<float> *result) {
+      if (HOG_FUSED == options.engine && CV_8U == input.depth() &&
+          (1 == input.channels() || 3 == input.channels() ||
+           4 == input.channels())) {
+        CreateFused(input, options, workspace, result);
+        return;
+      }
+      cv::Mat &processed = workspace->processed;
 
       // Grayscalization
       cv::cvtColor(input, processed, cv::COLOR_BGR2GRAY);
@@ -68,28 +249,88 @@ namespace icon_fitter {
       cv::normalize(processed, processed, 0, 255, cv::NORM_MINMAX);
       
       // Gradient
-      cv::Mat gradx(input.rows, input.cols, CV_32FC1);
-      cv::Mat grady(input.rows, input.cols, CV_32FC1);
-      
-      cv::Sobel(processed, gradx, CV_32F, 1, 0);
-      cv::Sobel(processed, grady, CV_32F, 0, 1);
+      cv::Sobel(processed, workspace->gradx, CV_32F, 1, 0);
+      cv::Sobel(processed, workspace->grady, CV_32F, 0, 1);
     
     
       // Histogram voting
-      FeatureImage<float> result(input.rows, input.cols, options.bins);
+      result->Reshape(input.rows, input.cols, options.bins);
+      if (HOG_NAIVE == options.engine) {
+        VoteNaive(workspace->gradx, workspace->grady, options, result);
+      } else {
+        VoteIntegral(workspace->gradx, workspace->grady, options, workspace,
+                     result);
+      }
+      result->Normalize();
+    }
+
+    // Features only at the positions inside regions (see Region), for
+    // a fraction of the work when the regions are small. Each region
+    // is computed from a crop of input that also holds the pixels its
+    // cells and gradients read, so features inside differ from the
+    // whole frame ones only through the gray level normalization,
+    // which is per region. Features outside are left unspecified. No
+    // regions computes the whole frame.
+    static void Create(const cv::Mat &input, HogOptions options,
+                       const std::vector<Region> &regions,
+                       HogWorkspace *workspace,
+                       FeatureImage<float> *result) {
+      if (regions.empty()) {
+        Create(input, options, workspace, result);
+        return;
+      }
+      result->Reshape(input.rows, input.cols, options.bins, false);
+      FeatureImage<float> &features = workspace->region;
+      for (const Region &region : regions) {
+        int y0 = std::max(region.y, 0);
+        int x0 = std::max(region.x, 0);
+        int y1 = std::min(region.y + region.height, input.rows);
+        int x1 = std::min(region.x + region.width, input.cols);
+        if (y1 <= y0 || x1 <= x0) continue;
+        // The cell at (y, x) covers pixels y .. y + cell_size - 1, and
+        // Sobel reads one more pixel around those.
+        cv::Rect crop(std::max(x0 - 1, 0), std::max(y0 - 1, 0), 0, 0);
+        crop.width = std::min(x1 + options.cell_size, input.cols) - crop.x;
+        crop.height = std::min(y1 + options.cell_size, input.rows) - crop.y;
+        Create(input(crop), options, workspace, &features);
+        for (int y = y0; y < y1; ++y) {
+          memcpy(result->mutable_feature(y, x0),
+                 features.feature(y - crop.y, x0 - crop.x),
+                 sizeof(float) * (x1 - x0) * options.bins);
+        }
+      }
+    }
+
+    static FeatureImage<float> Create(const std::string &filename, 
+                                      HogOptions options) {
+      cv::Mat input = cv::imread(filename);
+      if (input.empty()) {
+        printf("Error: Failed to read image %s\n", filename.c_str());
+        exit(-1);
+      }
+      return Create(input, options);
+    }
+
+    // ---------- Voting Backends ----------
+    // Both accumulate the bilinear (tent) weighted histogram of the
+    // cell_size x cell_size cell anchored at each pixel into result.
+
+    static void VoteNaive(const cv::Mat &gradx, const cv::Mat &grady,
+                          const HogOptions &options,
+                          FeatureImage<float> *result) {
       OrientationBucketer bucketer(options);
       double half_cell_size = options.cell_size * 0.5;
       
-      for (int i = 0; i < input.rows; ++i) {
-        float *gxptr = gradx.ptr<float>(i);
-        float *gyptr = grady.ptr<float>(i);
-        for (int j = 0; j < input.cols; ++j) {
+      for (int i = 0; i < gradx.rows; ++i) {
+        const float *gxptr = gradx.ptr<float>(i);
+        const float *gyptr = grady.ptr<float>(i);
+        for (int j = 0; j < gradx.cols; ++j) {
           auto vote = bucketer(*(gyptr++), *(gxptr++));
           for (int y = i - options.cell_size + 1; y <= i; ++y) {
             if (0 > y) continue;
             for (int x = j - options.cell_size + 1; x <= j; ++x) {
               if (0 > x) continue;
-              float *feature = result.mutable_feature(y, x);
+              float *feature = result->mutable_feature(y, x);
               double weight_y = fabs(i - y - half_cell_size) / options.cell_size;
               double weight_x = fabs(j - x - half_cell_size) / options.cell_size;
               feature[vote.first] += (1.0 - weight_x) * (1.0 - weight_y) * vote.second;
@@ -97,18 +338,389 @@ namespace icon_fitter {
           }
         }
       }
-      result.Normalize();
-      return result;
     }
 
-    static FeatureImage<float> Create(const std::string &filename, 
-                                      HogOptions options) {
-      cv::Mat input = cv::imread(filename);
-      if (input.empty()) {
-        printf("Error: Failed to read image %s\n", filename.c_str());
-        exit(-1);
+    // The cell weight is separable, w(dy) * w(dx) with
+    // w(d) = 1 - |d - cell_size / 2| / cell_size, so every bin plane
+    // is filtered by a 1D tent along rows and then along columns. The
+    // tent is two linear ramps, each evaluated in O(1) from prefix
+    // sums of v(t) and t * v(t), kept in the workspace buffers.
+    static void VoteIntegral(const cv::Mat &gradx, const cv::Mat &grady,
+                             const HogOptions &options,
+                             HogWorkspace *workspace,
+                             FeatureImage<float> *result) {
+      const int rows = gradx.rows;
+      const int cols = gradx.cols;
+      const int bins = options.bins;
+      const int row_size = cols * bins;
+      TentKernel tent(options.cell_size);
+
+      // Scatter every vote into the bin plane at its own pixel.
+      OrientationBucketer bucketer(options);
+      for (int i = 0; i < rows; ++i) {
+        const float *gxptr = gradx.ptr<float>(i);
+        const float *gyptr = grady.ptr<float>(i);
+        float *feature = result->mutable_feature(i, 0);
+        for (int j = 0; j < cols; ++j) {
+          auto vote = bucketer(*(gyptr++), *(gxptr++));
+          feature[vote.first] += vote.second;
+          feature += bins;
+        }
+      }
+
+      // Horizontal pass, one row at a time.
+      std::vector<double> &s0 = workspace->s0;
+      std::vector<double> &s1 = workspace->s1;
+      s0.resize((cols + 1) * bins);
+      s1.resize((cols + 1) * bins);
+      for (int i = 0; i < rows; ++i) {
+        float *row = result->mutable_feature(i, 0);
+        for (int b = 0; b < bins; ++b) {
+          s0[b] = 0.0;
+          s1[b] = 0.0;
+        }
+        for (int t = 0; t < cols; ++t) {
+          for (int b = 0; b < bins; ++b) {
+            double v = row[t * bins + b];
+            s0[(t + 1) * bins + b] = s0[t * bins + b] + v;
+            s1[(t + 1) * bins + b] = s1[t * bins + b] + t * v;
+          }
+        }
+        for (int x = 0; x < cols; ++x) {
+          int begin = x * bins;
+          int split = std::min(x + tent.split, cols) * bins;
+          int end = std::min(x + options.cell_size, cols) * bins;
+          for (int b = 0; b < bins; ++b) {
+            row[begin + b] = tent(&s0[0], &s1[0], begin + b, split + b,
+                                  end + b, x);
+          }
+        }
+      }
+
+      // Vertical pass. Prefix rows y .. y + cell_size are kept in a
+      // ring so that memory stays O(cell_size * W * bins). Input row y
+      // is folded into the prefix before output row y overwrites it.
+      const int ring = options.cell_size + 1;
+      std::vector<double> &p0 = workspace->p0;
+      std::vector<double> &p1 = workspace->p1;
+      p0.assign(ring * row_size, 0.0);
+      p1.assign(ring * row_size, 0.0);
+      int prefixed = 0;
+      for (int y = 0; y < rows; ++y) {
+        int end = std::min(y + options.cell_size, rows);
+        while (prefixed < end) {
+          const float *row = result->feature(prefixed, 0);
+          const double *last0 = &p0[(prefixed % ring) * row_size];
+          const double *last1 = &p1[(prefixed % ring) * row_size];
+          double *next0 = &p0[((prefixed + 1) % ring) * row_size];
+          double *next1 = &p1[((prefixed + 1) % ring) * row_size];
+          for (int k = 0; k < row_size; ++k) {
+            next0[k] = last0[k] + row[k];
+            next1[k] = last1[k] + static_cast<double>(prefixed) * row[k];
+          }
+          ++prefixed;
+        }
+        int split = std::min(y + tent.split, rows);
+        const double *begin0 = &p0[(y % ring) * row_size];
+        const double *begin1 = &p1[(y % ring) * row_size];
+        const double *split0 = &p0[(split % ring) * row_size];
+        const double *split1 = &p1[(split % ring) * row_size];
+        const double *end0 = &p0[(end % ring) * row_size];
+        const double *end1 = &p1[(end % ring) * row_size];
+        float *row = result->mutable_feature(y, 0);
+        for (int k = 0; k < row_size; ++k) {
+          row[k] = tent.Combine(begin0[k], begin1[k], split0[k], split1[k],
+                                end0[k], end1[k], y);
+        }
+      }
+    }
+
+    // The whole of Create for 8-bit input. Every band of output rows
+    // streams its input rows (plus cell_size - 1 rows below it)
+    // through gray conversion, min-max normalization, Sobel, binning
+    // and the cell filter, then normalizes the finished cells, so
+    // result is the only image-sized memory written.
+    //
+    // The cell filter is the tent of HOG_INTEGRAL applied as cell_size
+    // direct taps, in float. Along a row every pixel has a single
+    // vote, so the taps are scattered per pixel rather than per bin.
+    // Down the columns they run over a ring of cell_size filtered rows
+    // that stays in cache. For the usual small cells this is much less
+    // work and memory traffic than the double precision prefix sums.
+    //
+    // Gray conversion and normalization reproduce the fixed-point
+    // arithmetic of cv::cvtColor and cv::normalize on 8-bit images.
+    // The latter is affine in the gray level, which is what lets it
+    // become a 256 entry lookup table once a first, read-only pass has
+    // found the gray range.
+    static void CreateFused(const cv::Mat &input, const HogOptions &options,
+                            HogWorkspace *workspace,
+                            FeatureImage<float> *result) {
+      CreateFused(input, options, FindGrayRange(input, options.threads),
+                  workspace, result);
+    }
+
+    // CreateFused with the gray range given rather than found in input.
+    static void CreateFused(const cv::Mat &input, const HogOptions &options,
+                            const GrayRange &range,
+                            HogWorkspace *workspace,
+                            FeatureImage<float> *result) {
+      const int rows = input.rows;
+      const int cols = input.cols;
+      result->Reshape(rows, cols, options.bins, false);
+      if (0 == rows * cols) return;
+      const int bands = FusedBands(rows, options);
+
+      float table[256];
+      float scale = range.high > range.low ?
+        static_cast<float>(255.0 / (range.high - range.low)) : 0.0f;
+      float shift =
+        static_cast<float>(0.0 - range.low * static_cast<double>(scale));
+      for (int v = 0; v < 256; ++v) {
+        float level = std::nearbyint(v * scale + shift);
+        table[v] = std::min(std::max(level, 0.0f), 255.0f);
+      }
+
+      workspace->projector.Reset(options);
+      if (static_cast<int>(workspace->bands.size()) < bands) {
+        workspace->bands.resize(bands);
+      }
+      const bool fixed = kFixedCellSize == options.cell_size &&
+        kFixedBins == options.bins;
+#pragma omp parallel for schedule(static, 1) num_threads(bands) if (bands > 1)
+      for (int band = 0; band < bands; ++band) {
+        int y_begin = static_cast<int>(
+            static_cast<long long>(rows) * band / bands);
+        int y_end = static_cast<int>(
+            static_cast<long long>(rows) * (band + 1) / bands);
+        if (fixed) {
+          FusedBand<kFixedCellSize, kFixedBins>(
+              input, options, table, workspace->projector, y_begin, y_end,
+              &workspace->bands[band], result);
+        } else {
+          FusedBand<0, 0>(input, options, table, workspace->projector,
+                          y_begin, y_end, &workspace->bands[band], result);
+        }
+      }
+    }
+
+    // The gray range of 8-bit input. Ranges of parts of an image merge
+    // into the range of the whole.
+    static GrayRange FindGrayRange(const cv::Mat &input, int threads = 1) {
+      const int rows = input.rows;
+      const int cols = input.cols;
+      const int channels = input.channels();
+      int low = 255;
+      int high = 0;
+#ifdef _OPENMP
+      const int bands = std::max(1, std::min(threads, rows));
+#else
+      const int bands = 1;
+#endif
+#pragma omp parallel for schedule(static) num_threads(bands) if (bands > 1) reduction(min : low) reduction(max : high)
+      for (int i = 0; i < rows; ++i) {
+        const uchar *pixel = input.ptr<uchar>(i);
+        for (int j = 0; j < cols; ++j) {
+          int gray = Gray(pixel + j * channels, channels);
+          low = std::min(low, gray);
+          high = std::max(high, gray);
+        }
+      }
+      return GrayRange {low, high};
+    }
+
+  private:
+
+    // Row bands CreateFused splits rows into, one per thread.
+    static int FusedBands(int rows, const HogOptions &options) {
+#ifdef _OPENMP
+      return std::max(1, std::min(options.threads, rows / options.cell_size));
+#else
+      return 1;
+#endif
+    }
+
+    // cv::COLOR_BGR2GRAY on 8-bit pixels, with its 14 bit coefficients.
+    static inline int Gray(const uchar *pixel, int channels) {
+      if (1 == channels) return pixel[0];
+      return (pixel[0] * 1868 + pixel[1] * 9617 + pixel[2] * 4899 +
+              (1 << 13)) >> 14;
+    }
+
+    // cv::BORDER_REFLECT_101, which cv::Sobel uses by default.
+    static inline int Reflect(int i, int size) {
+      if (1 == size) return 0;
+      if (i < 0) return -i;
+      if (i >= size) return 2 * size - 2 - i;
+      return i;
+    }
+
+    // w(d) for d in [0, cell_size) as a rising ramp on [0, split) and a
+    // falling ramp on [split, cell_size).
+    struct TentKernel {
+      int split;
+      double rise;
+      double fall;
+      double slope;
+
+      explicit TentKernel(int cell_size) 
+        : split(std::min(static_cast<int>(cell_size * 0.5) + 1, cell_size)),
+          rise(0.5),
+          fall(1.5),
+          slope(1.0 / cell_size) {}
+
+      // Evaluates the tent anchored at t = x from prefix sums s0 (of v)
+      // and s1 (of t * v) sampled at the begin, split and end indices.
+      inline double Combine(double begin0, double begin1,
+                            double split0, double split1,
+                            double end0, double end1, int x) const {
+        double rising = (rise - slope * x) * (split0 - begin0) +
+          slope * (split1 - begin1);
+        double falling = (fall + slope * x) * (end0 - split0) -
+          slope * (end1 - split1);
+        return rising + falling;
+      }
+
+      inline double operator()(const double *s0, const double *s1,
+                               int begin, int split, int end, int x) const {
+        return Combine(s0[begin], s1[begin], s0[split], s1[split],
+                       s0[end], s1[end], x);
+      }
+    };
+
+    // ---------- Fused Rows ----------
+
+    // Normalized gray row i, from the band's ring of 3.
+    static const float *GrayRow(const cv::Mat &input, const float *table,
+                                int i, HogBand *band) {
+      int slot = i % 3;
+      float *gray = &band->gray[slot * input.cols];
+      if (band->gray_rows[slot] != i) {
+        const int channels = input.channels();
+        const uchar *pixel = input.ptr<uchar>(i);
+        for (int j = 0; j < input.cols; ++j) {
+          gray[j] = table[Gray(pixel + j * channels, channels)];
+        }
+        band->gray_rows[slot] = i;
+      }
+      return gray;
+    }
+
+    // Votes of input row i, tent-filtered along the row, into output
+    // (cols x bins). Non-zero template arguments replace cell_size and
+    // bins (see Fixed Configuration), as in FusedBand.
+    template <int kCellSize, int kBins>
+    static void FusedRow(const cv::Mat &input, const HogOptions &options,
+                         const float *table,
+                         const OrientationProjector &projector,
+                         int i, HogBand *band, float *output) {
+      const int rows = input.rows;
+      const int cols = input.cols;
+      const int bins = kBins > 0 ? kBins : options.bins;
+      const int cell_size = kCellSize > 0 ? kCellSize : options.cell_size;
+      const float *above = GrayRow(input, table, Reflect(i - 1, rows), band);
+      const float *center = GrayRow(input, table, i, band);
+      const float *below = GrayRow(input, table, Reflect(i + 1, rows), band);
+
+      // Sobel, separably: [1 2 1] and [-1 0 1] down the columns first,
+      // then the other one along the row.
+      float *smoothed = &band->smoothed[1];
+      float *difference = &band->difference[1];
+      for (int j = 0; j < cols; ++j) {
+        smoothed[j] = above[j] + 2.0f * center[j] + below[j];
+        difference[j] = below[j] - above[j];
+      }
+      smoothed[-1] = smoothed[Reflect(-1, cols)];
+      smoothed[cols] = smoothed[Reflect(cols, cols)];
+      difference[-1] = difference[Reflect(-1, cols)];
+      difference[cols] = difference[Reflect(cols, cols)];
+      float *gx = &band->gx[0];
+      float *gy = &band->gy[0];
+      float *magnitude = &band->magnitude[0];
+      for (int j = 0; j < cols; ++j) {
+        gx[j] = smoothed[j + 1] - smoothed[j - 1];
+        gy[j] = difference[j - 1] + 2.0f * difference[j] + difference[j + 1];
+        magnitude[j] = std::sqrt(gx[j] * gx[j] + gy[j] * gy[j]);
+      }
+
+      // Binning and voting. Pixel j lands in cells j - cell_size + 1
+      // to j.
+      int *bin = &band->bin[0];
+      projector.operator()<kBins>(gx, gy, cols, bin);
+      const float *taps = &band->taps[0];
+      std::fill(output, output + cols * bins, 0.0f);
+      // The first cell_size - 1 pixels reach fewer cells.
+      int head = std::min(cell_size - 1, cols);
+      for (int j = 0; j < head; ++j) {
+        float *cell = output + j * bins + bin[j];
+        for (int d = 0; d <= j; ++d) {
+          *cell += taps[d] * magnitude[j];
+          cell -= bins;
+        }
+      }
+      for (int j = head; j < cols; ++j) {
+        float *cell = output + j * bins + bin[j];
+        for (int d = 0; d < cell_size; ++d) {
+          *cell += taps[d] * magnitude[j];
+          cell -= bins;
+        }
+      }
+    }
+
+    // Output rows [y_begin, y_end) of CreateFused, normalized.
+    template <int kCellSize, int kBins>
+    static void FusedBand(const cv::Mat &input, const HogOptions &options,
+                          const float *table,
+                          const OrientationProjector &projector,
+                          int y_begin, int y_end, HogBand *band,
+                          FeatureImage<float> *result) {
+      const int rows = input.rows;
+      const int cols = input.cols;
+      const int bins = kBins > 0 ? kBins : options.bins;
+      const int row_size = cols * bins;
+      const int cell_size = kCellSize > 0 ? kCellSize : options.cell_size;
+
+      band->taps.resize(cell_size);
+      for (int d = 0; d < cell_size; ++d) {
+        band->taps[d] = static_cast<float>(
+            1.0 - fabs(d - cell_size * 0.5) / cell_size);
+      }
+      band->gray.resize(3 * cols);
+      std::fill(band->gray_rows, band->gray_rows + 3, -1);
+      band->smoothed.resize(cols + 2);
+      band->difference.resize(cols + 2);
+      band->gx.resize(cols);
+      band->gy.resize(cols);
+      band->magnitude.resize(cols);
+      band->bin.resize(cols);
+      band->filtered.resize(cell_size * row_size);
+
+      const float *taps = &band->taps[0];
+      int filtered = y_begin;
+      for (int y = y_begin; y < y_end; ++y) {
+        int end = std::min(y + cell_size, rows);
+        while (filtered < end) {
+          FusedRow<kCellSize, kBins>(
+              input, options, table, projector, filtered, band,
+              &band->filtered[(filtered % cell_size) * row_size]);
+          ++filtered;
+        }
+        float *output = result->mutable_feature(y, 0);
+        const float *first = &band->filtered[(y % cell_size) * row_size];
+        for (int k = 0; k < row_size; ++k) {
+          output[k] = taps[0] * first[k];
+        }
+        for (int d = 1; d < end - y; ++d) {
+          const float *row =
+            &band->filtered[((y + d) % cell_size) * row_size];
+          for (int k = 0; k < row_size; ++k) {
+            output[k] += taps[d] * row[k];
+          }
+        }
+        for (int j = 0; j < cols; ++j) {
+          algebra::Normalize(output + j * bins, bins);
+        }
       }
-      return Create(input, options);
     }
     
     
@@ -0,0 +1,190 @@
+#ifndef _ICON_FITTER_HOG_CORRELATION_
+#define _ICON_FITTER_HOG_CORRELATION_
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "opencv2/core.hpp"
+#include "opencv2/imgproc.hpp"
+
+#include "feature_image.h"
+
+namespace icon_fitter {
+
+  struct CorrelationPeak {
+    // Top left corner of the template in the source, in pixels.
+    int y = 0;
+    int x = 0;
+    // Mean per-pixel squared distance between the template and the
+    // source window; lower is better.
+    double score = 0.0;
+    // Where the template lands in the source.
+    cv::Rect box;
+  };
+
+  struct CorrelationResult {
+    // CV_32FC1, (source height - template height + 1) x (source width -
+    // template width + 1). Entry (y, x) scores the template placed with
+    // its top left corner at (y, x), like cv::TM_SQDIFF does.
+    cv::Mat scores;
+    // Best first.
+    std::vector<CorrelationPeak> peaks;
+  };
+
+  // Rigid whole-template detection. The template HOG is compared with
+  // every window of the source HOG at once:
+  //
+  //   |T - F_window|^2 = sum T^2 + sum_window F^2 - 2 corr(T, F)
+  //
+  // where the cross-correlation over all bins is one product of
+  // spectra per bin, summed in the frequency domain and brought back
+  // with a single inverse cv::dft, and the window sums come from an
+  // integral image. Unlike PatchMatch, this is deterministic and does
+  // a fixed amount of work per frame.
+  class HogCorrelator {
+  public:
+    explicit HogCorrelator(const FeatureImage<float> &target)
+      : height_(target.height), width_(target.width), depth_(target.depth),
+        energy_(0.0), dft_rows_(0), dft_cols_(0) {
+      Interleaved(target).copyTo(target_);
+      for (int id = 0; id < target.size(); ++id) {
+        const float *feature = target.feature(id);
+        for (int k = 0; k < depth_; ++k) {
+          energy_ += feature[k] * feature[k];
+        }
+      }
+    }
+
+    // Scores every placement of the template in source and returns
+    // the top_k best, each at least half a template away from the
+    // better ones.
+    CorrelationResult Detect(const FeatureImage<float> &source,
+                             int top_k = 1) {
+      CorrelationResult result;
+      if (source.depth != depth_ || source.height < height_ ||
+          source.width < width_ || 0 == height_ * width_) {
+        return result;
+      }
+      Prepare(source.height, source.width);
+
+      // Cross-correlation, accumulated over bins in the frequency domain.
+      cv::Mat source_features = Interleaved(source);
+      cv::Mat plane = cv::Mat::zeros(dft_rows_, dft_cols_, CV_32FC1);
+      cv::Mat roi = plane(cv::Rect(0, 0, source.width, source.height));
+      cv::Mat spectrum;
+      cv::Mat product;
+      cv::Mat accumulated = cv::Mat::zeros(dft_rows_, dft_cols_, CV_32FC1);
+      for (int k = 0; k < depth_; ++k) {
+        cv::extractChannel(source_features, roi, k);
+        cv::dft(plane, spectrum, 0, source.height);
+        cv::mulSpectrums(spectrum, spectra_[k], product, 0, true);
+        accumulated += product;
+      }
+      cv::Mat correlation;
+      cv::dft(accumulated, correlation,
+              cv::DFT_INVERSE | cv::DFT_SCALE | cv::DFT_REAL_OUTPUT);
+
+      // Squared norms of every source window.
+      cv::Mat norms(source.height, source.width, CV_64FC1);
+      for (int i = 0; i < source.height; ++i) {
+        double *row = norms.ptr<double>(i);
+        for (int j = 0; j < source.width; ++j) {
+          const float *feature = source.feature(i, j);
+          double square = 0.0;
+          for (int k = 0; k < depth_; ++k) {
+            square += feature[k] * feature[k];
+          }
+          row[j] = square;
+        }
+      }
+      cv::Mat integral;
+      cv::integral(norms, integral, CV_64F);
+
+      int rows = source.height - height_ + 1;
+      int cols = source.width - width_ + 1;
+      double area = static_cast<double>(height_) * width_;
+      result.scores.create(rows, cols, CV_32FC1);
+      for (int y = 0; y < rows; ++y) {
+        const double *top = integral.ptr<double>(y);
+        const double *bottom = integral.ptr<double>(y + height_);
+        const float *cross = correlation.ptr<float>(y);
+        float *score = result.scores.ptr<float>(y);
+        for (int x = 0; x < cols; ++x) {
+          double window = bottom[x + width_] - bottom[x] -
+            top[x + width_] + top[x];
+          score[x] = static_cast<float>(
+              std::max(energy_ + window - 2.0 * cross[x], 0.0) / area);
+        }
+      }
+
+      result.peaks = Peaks(result.scores, top_k);
+      return result;
+    }
+
+  private:
+    // FeatureImage storage viewed as a depth-channel float image.
+    static cv::Mat Interleaved(const FeatureImage<float> &image) {
+      return cv::Mat(image.height, image.width, CV_32FC(image.depth),
+                     const_cast<float*>(image.feature(0)));
+    }
+
+    // Template spectra for a source of this size. Kept until the
+    // source size changes, so a stream pays for them once.
+    void Prepare(int source_height, int source_width) {
+      // Circular correlation does not wrap for valid placements as
+      // long as the transform covers the source.
+      int rows = cv::getOptimalDFTSize(source_height);
+      int cols = cv::getOptimalDFTSize(source_width);
+      if (rows == dft_rows_ && cols == dft_cols_) return;
+      dft_rows_ = rows;
+      dft_cols_ = cols;
+      spectra_.resize(depth_);
+      cv::Mat plane = cv::Mat::zeros(dft_rows_, dft_cols_, CV_32FC1);
+      cv::Mat roi = plane(cv::Rect(0, 0, width_, height_));
+      for (int k = 0; k < depth_; ++k) {
+        cv::extractChannel(target_, roi, k);
+        cv::dft(plane, spectra_[k], 0, height_);
+      }
+    }
+
+    // Best scores first, each one clearing the half-template around it
+    // before the next is picked.
+    std::vector<CorrelationPeak> Peaks(const cv::Mat &scores,
+                                       int top_k) const {
+      std::vector<CorrelationPeak> peaks;
+      cv::Mat remaining = scores.clone();
+      for (int k = 0; k < top_k; ++k) {
+        double min_value, max_value;
+        cv::Point min_loc, max_loc;
+        cv::minMaxLoc(remaining, &min_value, &max_value, &min_loc, &max_loc);
+        if (min_value == std::numeric_limits<float>::max()) break;
+        CorrelationPeak peak;
+        peak.y = min_loc.y;
+        peak.x = min_loc.x;
+        peak.score = min_value;
+        peak.box = cv::Rect(min_loc.x, min_loc.y, width_, height_);
+        peaks.push_back(peak);
+
+        cv::Rect suppressed(min_loc.x - width_ / 2, min_loc.y - height_ / 2,
+                            width_, height_);
+        suppressed &= cv::Rect(0, 0, remaining.cols, remaining.rows);
+        remaining(suppressed).setTo(std::numeric_limits<float>::max());
+      }
+      return peaks;
+    }
+
+    int height_;
+    int width_;
+    int depth_;
+    // sum T^2 over the whole template.
+    double energy_;
+    cv::Mat target_;
+    int dft_rows_;
+    int dft_cols_;
+    std::vector<cv::Mat> spectra_;
+  };
+
+}  // namespace icon_fitter
+
+#endif  // _ICON_FITTER_HOG_CORRELATION_
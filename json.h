@@ -0,0 +1,30 @@
+#ifndef _ICON_FITTER_JSON_
+#define _ICON_FITTER_JSON_
+
+#include <cstdio>
+#include <string>
+
+namespace icon_fitter {
+
+  // text as a JSON string literal: quotes and backslashes escaped,
+  // control characters written as \u00XX.
+  inline std::string JsonQuote(const std::string &text) {
+    std::string quoted = "\"";
+    for (char c : text) {
+      if ('"' == c || '\\' == c) {
+        quoted += '\\';
+        quoted += c;
+      } else if (static_cast<unsigned char>(c) < 0x20) {
+        char escaped[8];
+        snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+        quoted += escaped;
+      } else {
+        quoted += c;
+      }
+    }
+    return quoted + "\"";
+  }
+
+}  // namespace icon_fitter
+
+#endif  // _ICON_FITTER_JSON_
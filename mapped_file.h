@@ -0,0 +1,75 @@
+#ifndef _ICON_FITTER_MAPPED_FILE_
+#define _ICON_FITTER_MAPPED_FILE_
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <string>
+
+namespace icon_fitter {
+
+  // A whole file mapped privately into memory. Pages are read lazily
+  // and writes stay local to the process (copy on write), so callers
+  // may treat the contents as scratch space.
+  class MappedFile {
+  public:
+    // Returns nullptr if the file cannot be opened or mapped.
+    static std::shared_ptr<MappedFile> Open(const std::string &path) {
+      int fd = open(path.c_str(), O_RDONLY);
+      if (fd < 0) return nullptr;
+      struct stat info;
+      if (0 != fstat(fd, &info) || 0 == info.st_size) {
+        close(fd);
+        return nullptr;
+      }
+      size_t length = static_cast<size_t>(info.st_size);
+      void *address = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE, fd, 0);
+      close(fd);
+      if (MAP_FAILED == address) return nullptr;
+      return std::shared_ptr<MappedFile>(new MappedFile(address, length));
+    }
+
+    MappedFile(const MappedFile &) = delete;
+    MappedFile &operator=(const MappedFile &) = delete;
+
+    ~MappedFile() {
+      munmap(address_, length_);
+    }
+
+    inline char *data() const {
+      return static_cast<char*>(address_);
+    }
+
+    inline size_t size() const {
+      return length_;
+    }
+
+    // Drops the pages lying wholly inside [offset, offset + length)
+    // from memory. They are read from the file again on the next
+    // access, so any writes to them are lost.
+    void Release(size_t offset, size_t length) const {
+      size_t page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+      size_t begin = (offset + page - 1) / page * page;
+      size_t end = std::min(offset + length, length_) / page * page;
+      if (begin < end) {
+        madvise(data() + begin, end - begin, MADV_DONTNEED);
+      }
+    }
+
+  private:
+    MappedFile(void *address, size_t length)
+      : address_(address), length_(length) {}
+
+    void *address_;
+    size_t length_;
+  };
+
+}  // namespace icon_fitter
+
+#endif  // _ICON_FITTER_MAPPED_FILE_
@@ -0,0 +1,87 @@
+#include <algorithm>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "match_server.h"
+
+using namespace icon_fitter;
+
+namespace {
+  volatile sig_atomic_t stop = 0;
+
+  void Stop(int) {
+    stop = 1;
+  }
+
+  void Usage(const char *program) {
+    printf("Usage: %s --template <image> [--template <image>]... "
+           "[--threads N] [--depth N] [--region y,x,height,width]... "
+           "[--follow] <input>...\n", program);
+  }
+}  // namespace
+
+// Matches every template against every input and writes one JSON line
+// per frame to stdout (see MatchServer). An input is a directory of
+// images, read in name order, or a video file or printf-style image
+// pattern. With --follow, directories are polled for new images until
+// SIGINT or SIGTERM; otherwise the server exits once every input has
+// ended. With --region, features are only computed and templates only
+// searched inside the given pixel rectangles of every frame, e.g. the
+// corners where channel logos sit. Progress and errors go to stderr.
+int main(int argc, char **argv) {
+  ServerOptions options;
+  std::vector<std::string> templates;
+  std::vector<std::string> inputs;
+  for (int i = 1; i < argc; ++i) {
+    if (0 == strcmp(argv[i], "--template") && i + 1 < argc) {
+      templates.push_back(argv[++i]);
+    } else if (0 == strcmp(argv[i], "--threads") && i + 1 < argc) {
+      options.threads = atoi(argv[++i]);
+    } else if (0 == strcmp(argv[i], "--depth") && i + 1 < argc) {
+      options.depth = std::max(1, atoi(argv[++i]));
+    } else if (0 == strcmp(argv[i], "--region") && i + 1 < argc) {
+      Region region;
+      if (4 != sscanf(argv[++i], "%d,%d,%d,%d", &region.y, &region.x,
+                      &region.height, &region.width)) {
+        Usage(argv[0]);
+        return -1;
+      }
+      options.stream.regions.push_back(region);
+    } else if (0 == strcmp(argv[i], "--follow")) {
+      options.follow = true;
+    } else if ('-' == argv[i][0]) {
+      Usage(argv[0]);
+      return -1;
+    } else {
+      inputs.push_back(argv[i]);
+    }
+  }
+  if (templates.empty() || inputs.empty()) {
+    Usage(argv[0]);
+    return -1;
+  }
+
+  MatchServer server(options, stdout);
+  for (const std::string &path : templates) {
+    server.AddTemplate(path);
+  }
+  for (const std::string &path : inputs) {
+    if (!server.AddStream(path)) {
+      fprintf(stderr, "Error: Failed to add stream %s\n", path.c_str());
+      return -1;
+    }
+  }
+
+  std::signal(SIGINT, Stop);
+  std::signal(SIGTERM, Stop);
+  fprintf(stderr, "Serving %d streams x %d templates on %d threads\n",
+          static_cast<int>(inputs.size()),
+          static_cast<int>(templates.size()), server.threads());
+  server.Run(&stop);
+  fprintf(stderr, "%lld frames, %.1f fps\n", server.frames(), server.fps());
+  return 0;
+}
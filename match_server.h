@@ -0,0 +1,456 @@
+#ifndef _ICON_FITTER_MATCH_SERVER_
+#define _ICON_FITTER_MATCH_SERVER_
+
+#include <dirent.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "opencv2/highgui.hpp"
+#include "opencv2/imgcodecs.hpp"
+#include "opencv2/videoio.hpp"
+
+#include "feature_image.h"
+#include "hog.h"
+#include "json.h"
+#include "simd_distance.h"
+#include "stream_match.h"
+#include "work_stealing_pool.h"
+
+namespace icon_fitter {
+
+  // The frames of one input, in order. The input is either a directory,
+  // whose image files are read in name order, or anything
+  // cv::VideoCapture opens (a video file or a printf-style image
+  // sequence such as frames/%04d.png).
+  class FrameSource {
+  public:
+    // With follow, a directory that has run out of images is listed
+    // again on the next Read, and images added since are picked up.
+    FrameSource(const std::string &path, bool follow)
+      : path_(path), directory_(false), follow_(follow), next_(0),
+        frames_(0) {
+      struct stat info;
+      if (0 == stat(path.c_str(), &info) && S_ISDIR(info.st_mode)) {
+        directory_ = true;
+        List();
+      } else {
+        capture_.open(path);
+      }
+    }
+
+    bool ok() const {
+      return directory_ || capture_.isOpened();
+    }
+
+    // The next frame and a label for it (the file name, or the frame
+    // number for videos). Returns false when there is no frame for
+    // now; only a followed directory may have more later.
+    bool Read(cv::Mat *frame, std::string *label) {
+      if (!directory_) {
+        if (!capture_.read(*frame)) return false;
+        *label = std::to_string(frames_++);
+        return true;
+      }
+      while (true) {
+        if (next_ >= files_.size()) {
+          if (!follow_ || !List()) return false;
+        }
+        const std::string &name = files_[next_++];
+        *frame = cv::imread(path_ + "/" + name);
+        if (!frame->empty()) {
+          *label = name;
+          return true;
+        }
+        fprintf(stderr, "Warning: skipping unreadable image %s/%s\n",
+                path_.c_str(), name.c_str());
+      }
+    }
+
+  private:
+    static bool IsImage(const std::string &name) {
+      static const char *extensions[] = {
+        ".jpg", ".jpeg", ".png", ".bmp", ".ppm", ".pgm", ".tif", ".tiff"};
+      std::string lower(name);
+      std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+      for (const char *extension : extensions) {
+        std::string suffix(extension);
+        if (lower.size() > suffix.size() &&
+            0 == lower.compare(lower.size() - suffix.size(), suffix.size(),
+                               suffix)) {
+          return true;
+        }
+      }
+      return false;
+    }
+
+    // Lists the images sorting after the last one read. Returns
+    // whether there are any.
+    bool List() {
+      std::string last = next_ > 0 ? files_[next_ - 1] : std::string();
+      files_.clear();
+      next_ = 0;
+      DIR *directory = opendir(path_.c_str());
+      if (nullptr == directory) return false;
+      while (struct dirent *entry = readdir(directory)) {
+        std::string name(entry->d_name);
+        if (IsImage(name) && (last.empty() || name > last)) {
+          files_.push_back(name);
+        }
+      }
+      closedir(directory);
+      std::sort(files_.begin(), files_.end());
+      if (files_.empty() && !last.empty()) {
+        // Keep the position for the next listing.
+        files_.push_back(last);
+        next_ = 1;
+        return false;
+      }
+      return !files_.empty();
+    }
+
+    std::string path_;
+    bool directory_;
+    bool follow_;
+    cv::VideoCapture capture_;
+    std::vector<std::string> files_;
+    size_t next_;
+    int frames_;
+  };
+
+  struct ServerOptions {
+    // Features and per-template solver settings, shared by all streams.
+    StreamOptions stream;
+
+    // Worker threads; 0 uses one per hardware thread.
+    int threads = 0;
+
+    // Frames of a stream that may be in flight (read, matched or
+    // waiting to be written) at once. Reading stops there until the
+    // oldest frame is written, which bounds the memory per stream.
+    int depth = 2;
+
+    // Keep polling directory inputs for new images, and run until
+    // stopped instead of until every input has ended.
+    bool follow = false;
+    int poll_ms = 100;
+
+    ServerOptions() {
+      stream.hog.engine = HOG_FUSED;
+    }
+  };
+
+  // Matches many templates against many concurrent streams, on one
+  // work stealing pool, and writes one JSON line per frame:
+  //
+  //   {"stream": "...", "frame": 0, "source": "...", "latency_ms": 1.5,
+  //    "matches": [{"template": "...", "y": 0, "x": 0, "energy": 0.1,
+  //                 "warm": false}, ...]}
+  //
+  // (on one line), where y and x are the mean offset of the template in
+  // the frame features (see MeanTransform). Every frame of a stream is
+  // one read task (decode, HOG, blocks) and one match task per
+  // template. The match tasks of a (stream, template) pair form a
+  // chain, frame after frame, so that each one is warm started from
+  // the previous frame. Different templates, frames and streams run in
+  // parallel, and lines of a stream are written in frame order.
+  class MatchServer {
+  public:
+    typedef algebra::simd::L2 Distance;
+
+    MatchServer(const ServerOptions &options, FILE *output)
+      : options_(options), output_(output), stopping_(false),
+        pool_(options.threads) {}
+
+    // Exits on failure, like HogGen::Create.
+    void AddTemplate(const std::string &path) {
+      std::unique_ptr<Template> entry(new Template);
+      entry->path = path;
+      entry->features.reset(new FeatureImage<float>(
+          HogGen::Create(path, options_.stream.hog)));
+      entry->blocks.reset(new BlockFeatureImage<float>(
+          entry->features.get(), options_.stream.block_size,
+          options_.stream.stride, BLOCK_MATERIALIZED));
+      templates_.push_back(std::move(entry));
+    }
+
+    // Add all templates first. Returns false if path cannot be read or
+    // a region cannot hold a whole block.
+    bool AddStream(const std::string &path) {
+      return AddStream(path, options_.stream.regions);
+    }
+
+    // A stream (channel) with its own regions of interest instead of
+    // the ones in the options. Frames too small for the regions are
+    // written with empty matches.
+    bool AddStream(const std::string &path,
+                   const std::vector<Region> &regions) {
+      const int extent = (options_.stream.block_size - 1) *
+        options_.stream.stride;
+      for (const Region &region : regions) {
+        if (region.y + region.height - extent <= std::max(region.y, 0) ||
+            region.x + region.width - extent <= std::max(region.x, 0)) {
+          fprintf(stderr, "Error: region %d,%d,%d,%d of %s does not hold "
+                  "a whole %dx%d pixel block\n", region.y, region.x,
+                  region.height, region.width, path.c_str(), extent + 1,
+                  extent + 1);
+          return false;
+        }
+      }
+      std::unique_ptr<Stream> stream(new Stream);
+      stream->path = path;
+      stream->regions = regions;
+      stream->source.reset(new FrameSource(path, options_.follow));
+      if (!stream->source->ok()) return false;
+      for (const std::unique_ptr<Template> &entry : templates_) {
+        stream->matchers.emplace_back(new StreamMatcher<Distance>(
+            entry->blocks.get(), options_.stream));
+      }
+      stream->matched.assign(templates_.size(), 0);
+      streams_.push_back(std::move(stream));
+      return true;
+    }
+
+    // Serves until every stream has ended (never, with follow) or
+    // until *stop becomes non-zero, and then finishes the frames in
+    // flight.
+    void Run(const volatile sig_atomic_t *stop) {
+      start_ = Clock::now();
+      while (0 == *stop) {
+        bool active = false;
+        for (const std::unique_ptr<Stream> &stream : streams_) {
+          std::lock_guard<std::mutex> lock(stream->mutex);
+          Pump(stream.get(), true);
+          active = active || options_.follow || !stream->ended ||
+            stream->in_flight > 0;
+        }
+        if (!active) break;
+        std::this_thread::sleep_for(
+            std::chrono::milliseconds(options_.poll_ms));
+      }
+      stopping_ = true;
+      pool_.Wait();
+    }
+
+    // Frames written so far, and per second since Run started.
+    long long frames() const {
+      return frames_.load();
+    }
+
+    double fps() const {
+      double seconds = std::chrono::duration<double>(
+          Clock::now() - start_).count();
+      return seconds > 0.0 ? frames_.load() / seconds : 0.0;
+    }
+
+    int threads() const {
+      return pool_.threads();
+    }
+
+  private:
+    typedef std::chrono::steady_clock Clock;
+
+    struct Template {
+      std::string path;
+      std::unique_ptr<FeatureImage<float> > features;
+      std::unique_ptr<BlockFeatureImage<float> > blocks;
+    };
+
+    struct Match {
+      Transform mean;
+      double energy = 0.0;
+      bool warm = false;
+    };
+
+    // One frame in flight. Recycled through Stream::spare, together
+    // with its buffers.
+    struct Frame {
+      int index = 0;
+      std::string label;
+      Clock::time_point start;
+      cv::Mat image;
+      HogWorkspace hog;
+      FeatureImage<float> features {0, 0, 0};
+      std::unique_ptr<BlockFeatureImage<float> > blocks;
+      std::vector<Match> matches;
+      // Templates not matched yet.
+      int remaining = 0;
+    };
+
+    // Everything below source and matchers is guarded by mutex.
+    struct Stream {
+      std::string path;
+      std::vector<Region> regions;
+      std::unique_ptr<FrameSource> source;
+      std::vector<std::unique_ptr<StreamMatcher<Distance> > > matchers;
+      std::mutex mutex;
+      bool reading = false;
+      bool ended = false;
+      int in_flight = 0;
+      int next_index = 0;
+      int next_output = 0;
+      // Per template, the index of the next frame it will match.
+      std::vector<int> matched;
+      std::map<int, std::shared_ptr<Frame> > frames;
+      std::vector<std::shared_ptr<Frame> > spare;
+    };
+
+    // Starts reading the next frame if the stream has room for it.
+    // A stream that has ended is only retried when asked to (by Run,
+    // which polls followed directories). Needs stream->mutex.
+    void Pump(Stream *stream, bool retry) {
+      if (stopping_ || stream->reading ||
+          stream->in_flight >= options_.depth ||
+          (stream->ended && !(retry && options_.follow))) {
+        return;
+      }
+      stream->reading = true;
+      ++stream->in_flight;
+      std::shared_ptr<Frame> frame;
+      if (stream->spare.empty()) {
+        frame = std::make_shared<Frame>();
+      } else {
+        frame = stream->spare.back();
+        stream->spare.pop_back();
+      }
+      pool_.Submit([this, stream, frame]() { Read(stream, frame); });
+    }
+
+    void Read(Stream *stream, std::shared_ptr<Frame> frame) {
+      frame->start = Clock::now();
+      if (!stream->source->Read(&frame->image, &frame->label)) {
+        std::lock_guard<std::mutex> lock(stream->mutex);
+        stream->reading = false;
+        stream->ended = true;
+        --stream->in_flight;
+        stream->spare.push_back(frame);
+        return;
+      }
+      HogGen::Create(frame->image, options_.stream.hog, stream->regions,
+                     &frame->hog, &frame->features);
+      if (nullptr == frame->blocks) {
+        frame->blocks.reset(new BlockFeatureImage<float>(
+            &frame->features, options_.stream.block_size,
+            options_.stream.stride, BLOCK_LAZY, &stream->regions));
+      } else {
+        frame->blocks->Reset(&frame->features, options_.stream.block_size,
+                             options_.stream.stride, BLOCK_LAZY,
+                             &stream->regions);
+      }
+      frame->matches.resize(templates_.size());
+
+      std::lock_guard<std::mutex> lock(stream->mutex);
+      stream->reading = false;
+      stream->ended = false;
+      frame->index = stream->next_index++;
+      frame->remaining = static_cast<int>(templates_.size());
+      stream->frames[frame->index] = frame;
+      for (int t = 0; t < static_cast<int>(templates_.size()); ++t) {
+        if (stream->matched[t] == frame->index) {
+          pool_.Submit([this, stream, frame, t]() {
+              MatchTemplate(stream, frame, t);
+            });
+        }
+      }
+      Pump(stream, false);
+    }
+
+    void MatchTemplate(Stream *stream, std::shared_ptr<Frame> frame, int t) {
+      const TemplateMatch &result = stream->matchers[t]->Process(
+          *frame->blocks);
+      Match &match = frame->matches[t];
+      match.mean = result.mean;
+      match.energy = result.energy;
+      match.warm = stream->matchers[t]->warm();
+
+      std::lock_guard<std::mutex> lock(stream->mutex);
+      stream->matched[t] = frame->index + 1;
+      auto next = stream->frames.find(frame->index + 1);
+      if (stream->frames.end() != next) {
+        std::shared_ptr<Frame> successor = next->second;
+        pool_.Submit([this, stream, successor, t]() {
+            MatchTemplate(stream, successor, t);
+          });
+      }
+      if (0 == --frame->remaining) {
+        Flush(stream);
+        Pump(stream, false);
+      }
+    }
+
+    // Writes the finished frames at the head of the stream, in order.
+    // Needs stream->mutex.
+    void Flush(Stream *stream) {
+      while (!stream->frames.empty()) {
+        auto head = stream->frames.begin();
+        std::shared_ptr<Frame> frame = head->second;
+        if (frame->index != stream->next_output || frame->remaining > 0) {
+          return;
+        }
+        Write(*stream, *frame);
+        stream->frames.erase(head);
+        stream->spare.push_back(frame);
+        --stream->in_flight;
+        ++stream->next_output;
+        ++frames_;
+      }
+    }
+
+    void Write(const Stream &stream, const Frame &frame) {
+      double latency = std::chrono::duration<double, std::milli>(
+          Clock::now() - frame.start).count();
+      std::string line = "{\"stream\": " + JsonQuote(stream.path) +
+        ", \"frame\": " + std::to_string(frame.index) +
+        ", \"source\": " + JsonQuote(frame.label) +
+        ", \"latency_ms\": " + Number(latency) + ", \"matches\": [";
+      for (size_t t = 0; t < frame.matches.size(); ++t) {
+        const Match &match = frame.matches[t];
+        if (t > 0) line += ", ";
+        line += "{\"template\": " + JsonQuote(templates_[t]->path) +
+          ", \"y\": " + std::to_string(match.mean.y) +
+          ", \"x\": " + std::to_string(match.mean.x) +
+          ", \"energy\": " + Number(match.energy) +
+          ", \"warm\": " + (match.warm ? "true" : "false") + "}";
+      }
+      line += "]}\n";
+      std::lock_guard<std::mutex> lock(output_mutex_);
+      fputs(line.c_str(), output_);
+      fflush(output_);
+    }
+
+    // JSON has no inf or nan; those become null.
+    static std::string Number(double value) {
+      if (!std::isfinite(value)) return "null";
+      char text[32];
+      snprintf(text, sizeof(text), "%.6g", value);
+      return text;
+    }
+
+    ServerOptions options_;
+    FILE *output_;
+    std::mutex output_mutex_;
+    std::vector<std::unique_ptr<Template> > templates_;
+    std::vector<std::unique_ptr<Stream> > streams_;
+    std::atomic<long long> frames_ {0};
+    Clock::time_point start_;
+    std::atomic<bool> stopping_;
+    // Declared last, so that its destructor finishes the tasks before
+    // the streams they use are destroyed.
+    WorkStealingPool pool_;
+  };
+
+}  // namespace icon_fitter
+
+#endif  // _ICON_FITTER_MATCH_SERVER_
@@ -0,0 +1,419 @@
+#ifndef _ICON_FITTER_PATCH_INDEX_
+#define _ICON_FITTER_PATCH_INDEX_
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <limits>
+#include <queue>
+#include <random>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "algebra.h"
+#include "feature_image.h"
+#include "patchmatch.h"
+#include "sparse_match.h"
+
+namespace icon_fitter {
+
+  struct PatchIndexOptions {
+    // Randomized k-d trees in the forest, and the most patches a leaf
+    // holds.
+    int trees = 4;
+    int leaf_size = 8;
+
+    // Fraction of every template's patches indexed, the most salient
+    // ones (see SalientPatches), but never fewer than min_patches.
+    double fraction = 0.5;
+    int min_patches = 16;
+    PatchSaliency saliency = SALIENCY_ENTROPY;
+
+    // Indexed patches compared per query, over all trees together.
+    // More checks find the true nearest patch more often.
+    int checks = 16;
+
+    // Every query_step-th source block along both axes is queried. A
+    // template present in the source still collects about its indexed
+    // patches / query_step^2 consistent votes.
+    int query_step = 3;
+
+    // Votes at most this many blocks apart, along both axes, count
+    // for the same detection.
+    int vote_radius = 2;
+
+    // Query threads; 0 uses every core OpenMP reports.
+    int threads = 0;
+  };
+
+  struct IndexMatch {
+    // Index into the template list passed to PatchIndex.
+    int template_id = 0;
+    // Where the template lands in the source, as the mean transform of
+    // PatchMatch would report it.
+    Transform transform;
+    // Votes that agree with transform, out of all the votes the
+    // template received.
+    int support = 0;
+    int votes = 0;
+    // Average per-patch distance of the template placed rigidly at
+    // transform, for telling templates that are present from ones that
+    // merely collected votes. The largest double when the placement
+    // leaves the source.
+    double energy = std::numeric_limits<double>::max();
+  };
+
+  // An approximate nearest neighbor index over the block patches of a
+  // whole template library: a forest of randomized k-d trees, searched
+  // best bin first with a fixed budget of checks per query (Muja and
+  // Lowe's FLANN scheme). Built once, it is queried with the patches
+  // of every source, and each source patch votes for the transform
+  // that maps its nearest template patch onto it. A query costs about
+  // log(size()) + checks distances however many templates there are,
+  // where PatchMatch solves every template separately.
+  //
+  // The templates are referenced, not copied, and must outlive the
+  // index. Materialized templates make the leaf distances fastest.
+  template <typename Distance = algebra::L2>
+  class PatchIndex {
+  public:
+    PatchIndex(const std::vector<const BlockFeatureImage<float>*> &templates,
+               const PatchIndexOptions &options)
+      : templates_(templates), options_(options), dimension_(0) {
+      SparsePatchMatchOptions selection;
+      selection.fraction = options_.fraction;
+      selection.min_patches = options_.min_patches;
+      selection.saliency = options_.saliency;
+      selection.neighbors = 0;
+      selection.neighbor_radius = 0;
+      for (int t = 0; t < static_cast<int>(templates_.size()); ++t) {
+        const BlockFeatureImage<float> &target = *templates_[t];
+        if (0 == target.height * target.width) continue;
+        if (0 == dimension_) dimension_ = target.dimension;
+        if (target.dimension != dimension_) {
+          printf("[ERROR] templates of different dimensions in one "
+                 "index.\n");
+          exit(-1);
+        }
+        SalientPatches salient(target, selection);
+        for (int k = 0; k < salient.size(); ++k) {
+          Entry entry;
+          entry.template_id = t;
+          entry.position = salient.position(k);
+          entries_.push_back(entry);
+        }
+      }
+
+      // Coordinates, contiguous for the tree building passes.
+      const int count = size();
+      std::vector<float> points(static_cast<size_t>(count) * dimension_);
+      for (int n = 0; n < count; ++n) {
+        const Patch<float> &patch = GetPatch(n);
+        float *point = &points[static_cast<size_t>(n) * dimension_];
+        for (int d = 0; d < dimension_; ++d) {
+          point[d] = patch[d];
+        }
+      }
+      std::mt19937 generator(static_cast<unsigned>(count));
+      trees_.resize(std::max(options_.trees, 1));
+      for (Tree &tree : trees_) {
+        tree.order.resize(count);
+        for (int n = 0; n < count; ++n) {
+          tree.order[n] = n;
+        }
+        if (count > 0) Build(points, 0, count, &generator, &tree);
+      }
+    }
+
+    // Patches indexed over all templates.
+    int size() const {
+      return static_cast<int>(entries_.size());
+    }
+
+    // Queries the source's patches in row batches, one per thread at a
+    // time, and returns the voted transform of every template, in
+    // template order. A template without votes has support 0. When
+    // source was built with regions, only its valid blocks are queried.
+    std::vector<IndexMatch> Match(const BlockFeatureImage<float> &source)
+      const {
+      const int count = static_cast<int>(templates_.size());
+      std::vector<IndexMatch> matches(count);
+      for (int t = 0; t < count; ++t) {
+        matches[t].template_id = t;
+      }
+      if (0 == size() || 0 == source.height * source.width) {
+        return matches;
+      }
+      if (source.dimension != dimension_) {
+        printf("[ERROR] dimension mismatch between source and index.\n");
+        exit(-1);
+      }
+
+      const int step = std::max(options_.query_step, 1);
+      const int rows = (source.height + step - 1) / step;
+      const RegionMask *regions = source.regions();
+#ifdef _OPENMP
+      const int threads = options_.threads > 0 ?
+        options_.threads : omp_get_max_threads();
+#else
+      const int threads = 1;
+#endif
+      // Votes per thread and template, merged afterwards.
+      std::vector<std::vector<std::vector<Transform> > > transforms(
+          threads, std::vector<std::vector<Transform> >(count));
+      std::vector<std::vector<std::vector<double> > > scores(
+          threads, std::vector<std::vector<double> >(count));
+#pragma omp parallel num_threads(threads) if (threads > 1)
+      {
+        const int thread = ThreadIndex();
+        SearchState state(size(), dimension_);
+#pragma omp for schedule(dynamic, 1)
+        for (int row = 0; row < rows; ++row) {
+          const int y = row * step;
+          for (int x = 0; x < source.width; x += step) {
+            if (nullptr != regions && !regions->Contains(y, x)) continue;
+            double score = 0.0;
+            int n = Nearest(source.GetPatch(y, x), &state, &score);
+            if (n < 0) continue;
+            const Entry &entry = entries_[n];
+            Transform transform;
+            transform.y = y - entry.position.y;
+            transform.x = x - entry.position.x;
+            transforms[thread][entry.template_id].push_back(transform);
+            scores[thread][entry.template_id].push_back(score);
+          }
+        }
+      }
+
+      std::vector<Transform> votes;
+      std::vector<double> distances;
+      for (int t = 0; t < count; ++t) {
+        votes.clear();
+        distances.clear();
+        for (int thread = 0; thread < threads; ++thread) {
+          votes.insert(votes.end(), transforms[thread][t].begin(),
+                       transforms[thread][t].end());
+          distances.insert(distances.end(), scores[thread][t].begin(),
+                           scores[thread][t].end());
+        }
+        matches[t].votes = static_cast<int>(votes.size());
+        matches[t].support = VoteTransform(
+            votes, distances, std::max(options_.vote_radius, 0),
+            &matches[t].transform);
+        if (matches[t].support > 0) {
+          matches[t].energy = RigidEnergy<float, Distance>(
+              source, *templates_[t], matches[t].transform);
+        }
+      }
+      return matches;
+    }
+
+  private:
+    struct Entry {
+      int template_id;
+      // Block position in the template.
+      Transform position;
+    };
+
+    // An inner node splits on dimension at value, with the patches
+    // below it in child[0]; a leaf (dimension < 0) holds the patches
+    // order[begin, end) of its tree.
+    struct Node {
+      int dimension;
+      float value;
+      int child[2];
+      int begin;
+      int end;
+    };
+
+    struct Tree {
+      std::vector<Node> nodes;
+      std::vector<int> order;
+    };
+
+    struct Branch {
+      // Squared distance from the query to the splitting plane that
+      // was crossed to get here, which orders the search.
+      float bound;
+      int tree;
+      int node;
+
+      bool operator>(const Branch &other) const {
+        return bound > other.bound;
+      }
+    };
+
+    // Per-thread scratch of Nearest.
+    struct SearchState {
+      std::vector<float> query;
+      // Stamp of the last query that compared each patch, so a patch
+      // found by several trees is compared once.
+      std::vector<int> visited;
+      int stamp;
+      std::vector<Branch> heap;
+
+      SearchState(int size, int dimension)
+        : query(dimension), visited(size, 0), stamp(0) {}
+    };
+
+    // Number of dimensions of highest variance among which a split
+    // dimension is drawn, and of patches the variance is estimated
+    // from, as in FLANN.
+    static constexpr int kSplitCandidates = 5;
+    static constexpr int kVarianceSamples = 128;
+
+    inline const Patch<float> &GetPatch(int n) const {
+      const Entry &entry = entries_[n];
+      return templates_[entry.template_id]->GetPatch(entry.position.y,
+                                                     entry.position.x);
+    }
+
+    // Builds the subtree over tree->order[begin, end) and returns its
+    // node index.
+    int Build(const std::vector<float> &points, int begin, int end,
+              std::mt19937 *generator, Tree *tree) {
+      int id = static_cast<int>(tree->nodes.size());
+      tree->nodes.push_back(Node {-1, 0.0f, {-1, -1}, begin, end});
+      if (end - begin <= std::max(options_.leaf_size, 1)) return id;
+
+      // Mean and variance of every dimension over a random sample.
+      int *order = &tree->order[0];
+      const int limit = kVarianceSamples;
+      int samples = std::min(end - begin, limit);
+      std::vector<int> sample(samples);
+      for (int s = 0; s < samples; ++s) {
+        sample[s] = samples < end - begin ?
+          order[begin + (*generator)() % (end - begin)] : order[begin + s];
+      }
+      std::vector<double> mean(dimension_, 0.0);
+      std::vector<double> variance(dimension_, 0.0);
+      for (int n : sample) {
+        const float *point = &points[static_cast<size_t>(n) * dimension_];
+        for (int d = 0; d < dimension_; ++d) {
+          mean[d] += point[d];
+        }
+      }
+      for (int d = 0; d < dimension_; ++d) {
+        mean[d] /= samples;
+      }
+      for (int n : sample) {
+        const float *point = &points[static_cast<size_t>(n) * dimension_];
+        for (int d = 0; d < dimension_; ++d) {
+          variance[d] += (point[d] - mean[d]) * (point[d] - mean[d]);
+        }
+      }
+
+      // Split on one of the most varying dimensions at its mean.
+      std::vector<int> dimensions(dimension_);
+      for (int d = 0; d < dimension_; ++d) {
+        dimensions[d] = d;
+      }
+      const int split_candidates = kSplitCandidates;
+      int candidates = std::min(split_candidates, dimension_);
+      std::partial_sort(dimensions.begin(), dimensions.begin() + candidates,
+                        dimensions.end(), [&variance](int a, int b) {
+                          return variance[a] > variance[b];
+                        });
+      int dimension = dimensions[(*generator)() % candidates];
+      float value = static_cast<float>(mean[dimension]);
+      auto below = [&points, this, dimension, value](int n) {
+        return points[static_cast<size_t>(n) * dimension_ + dimension] <
+          value;
+      };
+      int middle = static_cast<int>(
+          std::partition(order + begin, order + end, below) - order);
+      if (middle == begin || middle == end) {
+        // All patches on one side, e.g. duplicates: halve by rank.
+        middle = begin + (end - begin) / 2;
+        std::nth_element(order + begin, order + middle, order + end,
+                         [&points, this, dimension](int a, int b) {
+                           return points[static_cast<size_t>(a) * dimension_ +
+                                         dimension] <
+                             points[static_cast<size_t>(b) * dimension_ +
+                                    dimension];
+                         });
+        value = points[static_cast<size_t>(order[middle]) * dimension_ +
+                       dimension];
+      }
+
+      int left = Build(points, begin, middle, generator, tree);
+      int right = Build(points, middle, end, generator, tree);
+      Node &node = tree->nodes[id];
+      node.dimension = dimension;
+      node.value = value;
+      node.child[0] = left;
+      node.child[1] = right;
+      return id;
+    }
+
+    // The indexed patch nearest to patch among the ones the search
+    // budget reaches, or -1 when the index is empty. Every tree is
+    // descended once, then the closest unexplored branches of all of
+    // them are, until options_.checks patches have been compared.
+    int Nearest(const Patch<float> &patch, SearchState *state,
+                double *score) const {
+      float *query = &state->query[0];
+      for (int d = 0; d < dimension_; ++d) {
+        query[d] = patch[d];
+      }
+      if (++state->stamp == std::numeric_limits<int>::max()) {
+        std::fill(state->visited.begin(), state->visited.end(), 0);
+        state->stamp = 1;
+      }
+      std::vector<Branch> &heap = state->heap;
+      heap.clear();
+      std::greater<Branch> later;
+      int best = -1;
+      double best_score = std::numeric_limits<double>::max();
+      int checks = 0;
+      auto descend = [&](int t, int id) {
+        const Tree &tree = trees_[t];
+        const Node *node = &tree.nodes[id];
+        while (node->dimension >= 0) {
+          float difference = query[node->dimension] - node->value;
+          int near = difference < 0.0f ? 0 : 1;
+          heap.push_back(Branch {difference * difference, t,
+                node->child[1 - near]});
+          std::push_heap(heap.begin(), heap.end(), later);
+          node = &tree.nodes[node->child[near]];
+        }
+        for (int k = node->begin; k < node->end; ++k) {
+          int n = tree.order[k];
+          if (state->stamp == state->visited[n]) continue;
+          state->visited[n] = state->stamp;
+          ++checks;
+          double distance = algebra::BoundedDistance<Distance>(
+              patch, GetPatch(n), best_score);
+          if (distance < best_score) {
+            best_score = distance;
+            best = n;
+          }
+        }
+      };
+      for (int t = 0; t < static_cast<int>(trees_.size()); ++t) {
+        descend(t, 0);
+      }
+      while (checks < options_.checks && !heap.empty()) {
+        std::pop_heap(heap.begin(), heap.end(), later);
+        Branch branch = heap.back();
+        heap.pop_back();
+        descend(branch.tree, branch.node);
+      }
+      *score = best_score;
+      return best;
+    }
+
+    std::vector<const BlockFeatureImage<float>*> templates_;
+    PatchIndexOptions options_;
+    int dimension_;
+    std::vector<Entry> entries_;
+    std::vector<Tree> trees_;
+  };
+
+}  // namespace icon_fitter
+
+#endif  // _ICON_FITTER_PATCH_INDEX_
@@ -1,11 +1,23 @@
 #ifndef _ICON_FITTER_PATCHMATCH_
 #define _ICON_FITTER_PATCHMATCH_
 
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <limits>
 #include <random>
 #include <chrono>
 #include <tuple>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "algebra.h"
+#include "feature_image.h"
 
 namespace icon_fitter {
   
@@ -27,6 +39,21 @@ namespace icon_fitter {
     DataMatrix(DataMatrix<DataType> &&other) = default;
     DataMatrix<DataType> &operator=(DataMatrix<DataType> &&other) = default;
 
+    // Explicit deep copy, reusing the existing buffer when possible.
+    void CopyFrom(const DataMatrix<DataType> &other) {
+      height = other.height;
+      width = other.width;
+      matrix_ = other.matrix_;
+    }
+
+    // Changes the shape, leaving the contents unspecified. The buffer
+    // is only reallocated when it has to grow.
+    void Resize(int height_, int width_) {
+      height = height_;
+      width = width_;
+      matrix_.resize(height * width);
+    }
+
     DataType &operator()(int i, int j) {
       return matrix_[i * width + j];
     }
@@ -35,7 +62,7 @@ namespace icon_fitter {
       return matrix_[i * width + j];
     }
 
-    inline const std::vector<DataType> &data() {
+    inline const std::vector<DataType> &data() const {
       return matrix_;
     }
     
@@ -45,6 +72,59 @@ namespace icon_fitter {
 
   typedef DataMatrix<Transform> TransformMap;
 
+  // What PatchMatch did in one phase: initialization (round -1) or one
+  // propagation round.
+  struct PatchMatchStats {
+    int round = -1;
+    // Target patches whose match improved.
+    int updates = 0;
+    // Distance evaluations, by the step that asked for them.
+    long long initial_evaluations = 0;
+    long long search_evaluations = 0;
+    long long propagation_evaluations = 0;
+    // Sum of the best scores at the end of the phase. It is carried
+    // along from score improvements, not recomputed.
+    double energy = 0.0;
+    // Wall time in milliseconds. The per-step times are summed over
+    // threads when the round runs in parallel.
+    double search_ms = 0.0;
+    double propagation_ms = 0.0;
+    double total_ms = 0.0;
+  };
+
+  typedef std::function<void(const PatchMatchStats&)> PatchMatchObserver;
+
+  // What one scan changed: how many patches improved, and by how much
+  // the energy and the transform sums moved.
+  struct ScanDelta {
+    int updates = 0;
+    double energy = 0.0;
+    long long y = 0;
+    long long x = 0;
+
+    ScanDelta &operator+=(const ScanDelta &other) {
+      updates += other.updates;
+      energy += other.energy;
+      y += other.y;
+      x += other.x;
+      return *this;
+    }
+  };
+
+  // Everything PatchMatch allocates, kept between calls that pass the
+  // same workspace. Once the buffers have grown to the frame size,
+  // solving further frames of that size does not allocate.
+  struct PatchMatchWorkspace {
+    TransformMap result {0, 0};
+    DataMatrix<double> score_map {0, 0};
+    // Snapshot read across band borders by the parallel solver.
+    TransformMap halo {0, 0};
+    // Seeded on first use and then left running, not reseeded.
+    std::vector<std::mt19937> generators;
+    std::vector<ScanDelta> band_deltas;
+    std::vector<PatchMatchStats> band_stats;
+  };
+
   struct PatchMatchOptions {
     int initial_candidates = 5;
     int iterations = 10;
@@ -55,6 +135,33 @@ namespace icon_fitter {
     // If the update rate is below this threshold, terminate the
     // algroithm.
     double termination_update_rate = 0.05;
+
+    // Also terminate once a round after the first lowers the energy by
+    // less than this fraction of it. 0 disables the test.
+    double termination_energy_decrease = 0.0;
+
+    // Also terminate once the mean transform (see MeanTransform) has
+    // moved by at most termination_mean_tolerance blocks, along both
+    // axes, for this many consecutive rounds. 0 disables the test.
+    int termination_stable_rounds = 0;
+    double termination_mean_tolerance = 0.5;
+
+    // 1 runs the sequential raster / reverse raster scan. Anything else
+    // runs the row-band parallel solver on that many threads, or on
+    // every core OpenMP reports when 0.
+    int threads = 1;
+
+    // Initial random search radius in source pixels. 0 covers the
+    // whole source; small values suit refining a good initialization.
+    double max_search_radius = 0.0;
+
+    // Print the energy after every round.
+    bool verbose = true;
+
+    // Receives PatchMatchStats after initialization and after every
+    // round. When empty, the instrumented scan is not even
+    // instantiated, so it costs nothing.
+    PatchMatchObserver observer;
   };
 
   namespace {
@@ -82,12 +189,16 @@ namespace icon_fitter {
       }
     };
 
+    // Whether a source location may be matched: inside the source and,
+    // when the source has regions, inside them.
     struct BoundaryChecker {
       int height;
       int width;
+      const RegionMask *regions;
       
       inline bool operator()(int y, int x) {
-        return 0 <= y && y < height && 0 <= x && x < width;
+        return 0 <= y && y < height && 0 <= x && x < width &&
+          (nullptr == regions || regions->Contains(y, x));
       }
     };
 
@@ -107,139 +218,535 @@ namespace icon_fitter {
       }
       return energy;
     }
-  }  // namespace
 
-  template <typename DataType, typename Distance = algebra::L2>
-  TransformMap PatchMatch(const BlockFeatureImage<DataType> &source, 
-                          const BlockFeatureImage<DataType> &target,
-                          PatchMatchOptions options) {
+    // Average per-patch distance of target placed rigidly at transform,
+    // the largest double when the placement leaves the source.
+    template <typename DataType, typename Distance>
+    double RigidEnergy(const BlockFeatureImage<DataType> &source,
+                       const BlockFeatureImage<DataType> &target,
+                       const Transform &transform) {
+      if (transform.y < 0 || transform.x < 0 ||
+          transform.y + target.height > source.height ||
+          transform.x + target.width > source.width ||
+          0 == target.height * target.width) {
+        return std::numeric_limits<double>::max();
+      }
+      double energy = 0.0;
+      for (int i = 0; i < target.height; ++i) {
+        for (int j = 0; j < target.width; ++j) {
+          energy += Distance::Compute(target.GetPatch(i, j),
+                                      source.GetPatch(transform.y + i,
+                                                      transform.x + j));
+        }
+      }
+      return energy / (target.height * target.width);
+    }
 
-    if (source.dimension != target.dimension) {
-      printf("[ERROR] dimension mismatch between source and target.");
-      exit(-1);
+    inline int ResolveThreads(int requested) {
+#ifdef _OPENMP
+      return requested > 0 ? requested : omp_get_max_threads();
+#else
+      return 1;
+#endif
     }
-    // Initialize Random Generator
-    unsigned seed = std::chrono::system_clock::now().time_since_epoch().count();
-    std::mt19937 generator(seed);
-    
-    TransformMap result(target.height, target.width);
-    DataMatrix<double> score_map(target.height, target.width);
-    
-    // Initialization 
-    std::uniform_int_distribution<int> y_random(0, source.height - 1);
-    std::uniform_int_distribution<int> x_random(0, source.width - 1);
-    auto y_dice = std::bind(y_random, generator);
-    auto x_dice = std::bind(x_random, generator);
-    for (int i = 0; i < target.height; ++i) {
-      for (int j = 0; j < target.width; ++j) {
-        double &score = score_map(i, j);
-        Transform &transform = result(i, j);
-        for (int k = 0; k < options.initial_candidates; ++k) {
-          int y = y_dice();
-          int x = x_dice();
-          double current_score = Distance::Compute(target.GetPatch(i, j),
-                                                   source.GetPatch(y, x));
-          if (0 == k || current_score < score) {
-            score = current_score;
-            transform.y = y - i;
-            transform.x = x - j;
+
+    inline int ThreadIndex() {
+#ifdef _OPENMP
+      return omp_get_thread_num();
+#else
+      return 0;
+#endif
+    }
+
+    // One independently seeded generator per worker thread. Generators
+    // that already exist for this many threads are kept as they are.
+    inline void MakeGenerators(int threads,
+                               std::vector<std::mt19937> *generators) {
+      if (static_cast<int>(generators->size()) == threads) return;
+      std::seed_seq seeds {
+        static_cast<unsigned>(
+            std::chrono::system_clock::now().time_since_epoch().count())};
+      std::vector<unsigned> streams(threads);
+      seeds.generate(streams.begin(), streams.end());
+      generators->clear();
+      generators->reserve(threads);
+      for (unsigned stream : streams) {
+        generators->emplace_back(stream);
+      }
+    }
+
+    // Scores source location (y, x) for the target patch at (i, j) and
+    // adopts it when it beats the current score. Most candidates lose,
+    // so the distance is only computed as far as needed to tell.
+    template <typename DataType, typename Distance>
+    inline bool TryCandidate(const BlockFeatureImage<DataType> &source,
+                             const Patch<DataType> &patch,
+                             int i, int j, int y, int x,
+                             Transform *transform, double *score) {
+      double new_score = algebra::BoundedDistance<Distance>(
+          patch, source.GetPatch(y, x), *score);
+      if (new_score < *score) {
+        *score = new_score;
+        transform->y = y - i;
+        transform->x = x - j;
+        return true;
+      }
+      return false;
+    }
+
+    // Samples around the current match within a radius that starts at
+    // max_radius and shrinks by decay_rate until it drops to a pixel.
+    template <typename DataType, typename Distance, typename Generator>
+    inline bool RandomSearch(const BlockFeatureImage<DataType> &source,
+                             const Patch<DataType> &patch,
+                             int i, int j, double max_radius,
+                             double decay_rate,
+                             BoundaryChecker &in_boundary,
+                             Generator &generator,
+                             Transform *transform, double *score,
+                             long long *evaluations) {
+      std::uniform_real_distribution<double> offset(-1.0, 1.0);
+      int y0 = i + transform->y;
+      int x0 = j + transform->x;
+      bool updated = false;
+      double radius = max_radius;
+      while (radius > 1.0) {
+        int y1 = static_cast<int>(floor(y0 + offset(generator) * radius + 0.5));
+        int x1 = static_cast<int>(floor(x0 + offset(generator) * radius + 0.5));
+        if (in_boundary(y1, x1)) {
+          ++*evaluations;
+          updated |= TryCandidate<DataType, Distance>(source, patch, i, j,
+                                                      y1, x1,
+                                                      transform, score);
+        }
+        radius *= decay_rate;
+      }
+      return updated;
+    }
+
+    // Adopts the transform of a neighbouring target patch.
+    template <typename DataType, typename Distance>
+    inline bool Propagate(const BlockFeatureImage<DataType> &source,
+                          const Patch<DataType> &patch,
+                          int i, int j, const Transform &neighbor,
+                          BoundaryChecker &in_boundary,
+                          Transform *transform, double *score,
+                          long long *evaluations) {
+      int y = i + neighbor.y;
+      int x = j + neighbor.x;
+      if (!in_boundary(y, x)) return false;
+      ++*evaluations;
+      return TryCandidate<DataType, Distance>(source, patch, i, j, y, x,
+                                              transform, score);
+    }
+
+    // Best of `candidates` uniformly drawn source locations for every
+    // target patch, plus the transform at the same position in seed
+    // (clamped into the source) when one is given. Rows are
+    // independent, and each one draws from the generator of the thread
+    // that handles it. A source with regions is only sampled inside
+    // them, and a seed that falls outside is replaced by a sample.
+    template <typename DataType, typename Distance>
+    void RandomInitialize(const BlockFeatureImage<DataType> &source, 
+                          const BlockFeatureImage<DataType> &target,
+                          int candidates,
+                          const TransformMap *seed,
+                          std::vector<std::mt19937> *generators,
+                          TransformMap *result,
+                          DataMatrix<double> *score_map) {
+      std::uniform_int_distribution<int> y_random(0, source.height - 1);
+      std::uniform_int_distribution<int> x_random(0, source.width - 1);
+      const RegionMask *regions = source.regions();
+      if (nullptr == seed && candidates < 1) candidates = 1;
+      int threads = static_cast<int>(generators->size());
+#pragma omp parallel for schedule(static) num_threads(threads) if (threads > 1)
+      for (int i = 0; i < target.height; ++i) {
+        std::mt19937 &generator = (*generators)[ThreadIndex()];
+        auto sample = [&](int *y, int *x) {
+          if (nullptr != regions) {
+            regions->Sample(generator, y, x);
+          } else {
+            *y = y_random(generator);
+            *x = x_random(generator);
+          }
+        };
+        for (int j = 0; j < target.width; ++j) {
+          const Patch<DataType> &patch = target.GetPatch(i, j);
+          double &score = (*score_map)(i, j);
+          Transform &transform = (*result)(i, j);
+          int y = 0;
+          int x = 0;
+          int k = 0;
+          if (nullptr != seed) {
+            const Transform &previous = seed->Get(i, j);
+            y = std::min(std::max(i + previous.y, 0), source.height - 1);
+            x = std::min(std::max(j + previous.x, 0), source.width - 1);
+            if (nullptr != regions && !regions->Contains(y, x)) {
+              sample(&y, &x);
+            }
+          } else {
+            sample(&y, &x);
+            k = 1;
+          }
+          score = Distance::Compute(patch, source.GetPatch(y, x));
+          transform.y = y - i;
+          transform.x = x - j;
+          for (; k < candidates; ++k) {
+            sample(&y, &x);
+            TryCandidate<DataType, Distance>(source, patch, i, j, y, x,
+                                             &transform, &score);
           }
         }
       }
     }
-    printf("Initial Energy: %.6lf\n", 
-           GetEnergy<DataType, Distance>(source, target, result));
+  }  // namespace
 
-    
-    // Iteration Preparation
-    PatchMatchControl control(target.height, target.width);
-    std::uniform_real_distribution<double> r_random;
-    auto r_dice = std::bind(r_random, generator);
-    double max_radius = source.height > source.width ? 
-      source.height : source.width;
-    BoundaryChecker in_boundary {source.height, source.width};
-    
-    // Iterations
-    for (int round = 0; round < options.iterations; ++round) {
-      int updates = 0;
-      for (int i = control.y_begin; i != control.y_end; 
-           i += control.y_delta) {
+  namespace {
+    typedef std::chrono::steady_clock StatsClock;
+
+    inline double Milliseconds(StatsClock::duration duration) {
+      return std::chrono::duration<double, std::milli>(duration).count();
+    }
+
+    // One raster (or reverse raster, depending on control) scan over
+    // target rows [row_begin, row_end). Propagation from a row outside
+    // that range reads the snapshot `halo` instead of the live map,
+    // which lets disjoint row bands be scanned concurrently. With
+    // kStats, evaluations and step times are added to *stats.
+    template <typename DataType, typename Distance, bool kStats>
+    ScanDelta ScanRows(const BlockFeatureImage<DataType> &source, 
+                 const BlockFeatureImage<DataType> &target,
+                 const PatchMatchOptions &options,
+                 const PatchMatchControl &control,
+                 int row_begin, int row_end,
+                 double max_radius,
+                 std::mt19937 *generator,
+                 const TransformMap *halo,
+                 TransformMap *result,
+                 DataMatrix<double> *score_map,
+                 PatchMatchStats *stats) {
+      BoundaryChecker in_boundary {source.height, source.width,
+                                   source.regions()};
+      long long search_evaluations = 0;
+      long long propagation_evaluations = 0;
+      StatsClock::duration search_time = StatsClock::duration::zero();
+      StatsClock::duration propagation_time = StatsClock::duration::zero();
+      ScanDelta delta;
+      int first = control.y_delta > 0 ? row_begin : row_end - 1;
+      int last = control.y_delta > 0 ? row_end : row_begin - 1;
+      for (int i = first; i != last; i += control.y_delta) {
         for (int j = control.x_begin; j != control.x_end;
              j += control.x_delta) {
-          // Preparation
-          Transform &transform = result(i, j);
-          double &score = score_map(i, j);
-          int y0 = i + transform.x;
-          int x0 = j + transform.y;
-          bool updated = false;
-          
+          const Patch<DataType> &patch = target.GetPatch(i, j);
+          Transform &transform = (*result)(i, j);
+          double &score = (*score_map)(i, j);
+          const double initial_score = score;
+          const Transform initial = transform;
+          StatsClock::time_point start;
+          if (kStats) start = StatsClock::now();
+
           // Random Search
-          int dy = r_dice();
-          int dx = r_dice();
-          double radius = max_radius;
-          while (radius > 1.0) {
-            int y1 = static_cast<int>(y0 + dy * radius + 0.5);
-            int x1 = static_cast<int>(x0 + dx * radius + 0.5);
-            if (in_boundary(y1, x1)) {
-              double new_score = Distance::Compute(target.GetPatch(i, j),
-                                                   source.GetPatch(y1, x1));
-              if (new_score < score) {
-                score = new_score;
-                transform.y = y1 - i;
-                transform.x = x1 - j;
-                updated = true;
-              }
-            }
-            
-            radius *= options.decay_rate;
-          }
+          bool updated = RandomSearch<DataType, Distance>(
+              source, patch, i, j, max_radius, options.decay_rate,
+              in_boundary, *generator, &transform, &score,
+              &search_evaluations);
+          StatsClock::time_point searched;
+          if (kStats) searched = StatsClock::now();
           
           // Propagation
-          Transform new_transform;
-          for (int k = 0; k < 2; ++k) {
-            if (0 == k) {
-              int new_i = i - control.y_delta;
-              if (0 <= new_i && new_i < target.height) {
-                new_transform = result(new_i, j);
-              } else {
-                continue;
-              }
-            } else {
-              int new_j = j - control.x_delta;
-              if (0 <= new_j && new_j < target.width) {
-                new_transform = result(i, new_j);
-              } else {
-                continue;
-              }
-            }
-            int y2 = i + new_transform.y;
-            int x2 = j + new_transform.x;
-            if (in_boundary(y2, x2)) {
-              double new_score = Distance::Compute(target.GetPatch(i, j),
-                                                   source.GetPatch(y2, x2));
-              if (new_score < score) {
-                score = new_score;
-                transform = new_transform;
-                updated= true;
-              }
-            }
+          int new_i = i - control.y_delta;
+          if (0 <= new_i && new_i < target.height) {
+            const TransformMap *neighbors = 
+              (row_begin <= new_i && new_i < row_end) ? result : halo;
+            updated |= Propagate<DataType, Distance>(
+                source, patch, i, j, neighbors->Get(new_i, j),
+                in_boundary, &transform, &score, &propagation_evaluations);
+          }
+          int new_j = j - control.x_delta;
+          if (0 <= new_j && new_j < target.width) {
+            updated |= Propagate<DataType, Distance>(
+                source, patch, i, j, result->Get(i, new_j),
+                in_boundary, &transform, &score, &propagation_evaluations);
           }
-          if (updated) updates++;
-        }  // for i
-      }  // for j
-      printf("Round %d Energy: %.6lf\n", round,
-             GetEnergy<DataType, Distance>(source, target, result));
-      if (updates < static_cast<int>(target.height * target.width *
-                                     options.termination_update_rate)) {
-        printf("Early termination.\n");
-        break;
+          if (updated) {
+            delta.updates++;
+            delta.energy += score - initial_score;
+            delta.y += transform.y - initial.y;
+            delta.x += transform.x - initial.x;
+          }
+          if (kStats) {
+            propagation_time += StatsClock::now() - searched;
+            search_time += searched - start;
+          }
+        }  // for j
+      }  // for i
+      if (kStats) {
+        stats->search_evaluations += search_evaluations;
+        stats->propagation_evaluations += propagation_evaluations;
+        stats->search_ms += Milliseconds(search_time);
+        stats->propagation_ms += Milliseconds(propagation_time);
+      }
+      return delta;
+    }
+
+    // Tile-parallel round: the target is cut into one row band per
+    // generator and every band runs its own scan. Bands exchange
+    // matches through a snapshot of the map taken at the start of the
+    // round, so information crosses a band border once per round.
+    template <typename DataType, typename Distance, bool kStats>
+    ScanDelta BandRound(const BlockFeatureImage<DataType> &source, 
+                  const BlockFeatureImage<DataType> &target,
+                  const PatchMatchOptions &options,
+                  const PatchMatchControl &control,
+                  double max_radius,
+                  PatchMatchWorkspace *workspace,
+                  PatchMatchStats *stats) {
+      std::vector<std::mt19937> *generators = &workspace->generators;
+      TransformMap *halo = &workspace->halo;
+      TransformMap *result = &workspace->result;
+      DataMatrix<double> *score_map = &workspace->score_map;
+      int bands = static_cast<int>(generators->size());
+      if (bands > target.height) bands = target.height;
+      halo->CopyFrom(*result);
+      std::vector<PatchMatchStats> &band_stats = workspace->band_stats;
+      std::vector<ScanDelta> &band_deltas = workspace->band_deltas;
+      band_stats.assign(kStats ? bands : 0, PatchMatchStats());
+      band_deltas.assign(bands, ScanDelta());
+#pragma omp parallel for schedule(static, 1) num_threads(bands)
+      for (int band = 0; band < bands; ++band) {
+        int row_begin = static_cast<int>(
+            static_cast<long long>(target.height) * band / bands);
+        int row_end = static_cast<int>(
+            static_cast<long long>(target.height) * (band + 1) / bands);
+        band_deltas[band] = ScanRows<DataType, Distance, kStats>(
+            source, target, options, control, row_begin, row_end,
+            max_radius, &(*generators)[band], halo, result, score_map,
+            kStats ? &band_stats[band] : nullptr);
       }
+      ScanDelta delta;
+      for (const ScanDelta &band : band_deltas) {
+        delta += band;
+      }
+      for (const PatchMatchStats &band : band_stats) {
+        stats->search_evaluations += band.search_evaluations;
+        stats->propagation_evaluations += band.propagation_evaluations;
+        stats->search_ms += band.search_ms;
+        stats->propagation_ms += band.propagation_ms;
+      }
+      return delta;
+    }
+  }  // namespace
+
+  namespace {
+    // The PatchMatch driver. kStats selects the instrumented scan and
+    // the observer calls. The energy and the transform sums behind the
+    // mean transform are summed once after initialization and then
+    // carried along from the changes every scan reports. The map is
+    // left in workspace->result.
+    template <typename DataType, typename Distance, bool kStats>
+    void Solve(const BlockFeatureImage<DataType> &source, 
+               const BlockFeatureImage<DataType> &target,
+               const PatchMatchOptions &options,
+               const TransformMap *initialization,
+               PatchMatchWorkspace *workspace,
+               double *final_energy) {
+      // Initialize Random Generators, one per worker thread
+      bool parallel = 1 != options.threads;
+      std::vector<std::mt19937> &generators = workspace->generators;
+      MakeGenerators(parallel ? ResolveThreads(options.threads) : 1,
+                     &generators);
+    
+      TransformMap &result = workspace->result;
+      DataMatrix<double> &score_map = workspace->score_map;
+      result.Resize(target.height, target.width);
+      score_map.Resize(target.height, target.width);
+      const int size = target.height * target.width;
+    
+      // Initialization 
+      PatchMatchStats stats;
+      StatsClock::time_point start;
+      if (kStats) start = StatsClock::now();
+      RandomInitialize<DataType, Distance>(source, target,
+                                           options.initial_candidates,
+                                           initialization, &generators,
+                                           &result, &score_map);
+      double energy = 0.0;
+      for (double score : score_map.data()) {
+        energy += score;
+      }
+      long long sum_y = 0;
+      long long sum_x = 0;
+      for (const Transform &transform : result.data()) {
+        sum_y += transform.y;
+        sum_x += transform.x;
+      }
+      if (kStats) {
+        long long per_patch = nullptr != initialization ?
+          options.initial_candidates + 1 :
+          std::max(options.initial_candidates, 1);
+        stats.initial_evaluations = per_patch * size;
+        stats.energy = energy;
+        stats.total_ms = Milliseconds(StatsClock::now() - start);
+        options.observer(stats);
+      }
+      if (options.verbose) {
+        printf("Initial Energy: %.6lf\n", energy);
+      }
+
+    
+      // Iteration Preparation
+      PatchMatchControl control(target.height, target.width);
+      double max_radius = source.height > source.width ? 
+        source.height : source.width;
+      if (0 < options.max_search_radius &&
+          options.max_search_radius < max_radius) {
+        max_radius = options.max_search_radius;
+      }
+      if (parallel) workspace->halo.Resize(target.height, target.width);
+      int stable_rounds = 0;
+    
+      // Iterations
+      for (int round = 0; round < options.iterations; ++round) {
+        if (kStats) {
+          stats = PatchMatchStats();
+          stats.round = round;
+          start = StatsClock::now();
+        }
+        ScanDelta delta = parallel ?
+          BandRound<DataType, Distance, kStats>(source, target, options,
+                                                control, max_radius,
+                                                workspace, &stats) :
+          ScanRows<DataType, Distance, kStats>(source, target, options,
+                                               control, 0, target.height,
+                                               max_radius, &generators[0],
+                                               &result, &result, &score_map,
+                                               &stats);
+        double previous_energy = energy;
+        energy += delta.energy;
+        sum_y += delta.y;
+        sum_x += delta.x;
+        if (kStats) {
+          stats.updates = delta.updates;
+          stats.energy = energy;
+          stats.total_ms = Milliseconds(StatsClock::now() - start);
+          options.observer(stats);
+        }
+        if (options.verbose) {
+          printf("Round %d Energy: %.6lf\n", round, energy);
+        }
+
+        // Termination
+        bool converged = delta.updates <
+          static_cast<int>(size * options.termination_update_rate);
+        if (0 < round && 0.0 < options.termination_energy_decrease &&
+            previous_energy - energy <=
+            previous_energy * options.termination_energy_decrease) {
+          converged = true;
+        }
+        if (0 < options.termination_stable_rounds && size > 0) {
+          double moved = std::max(std::abs(static_cast<double>(delta.y)),
+                                  std::abs(static_cast<double>(delta.x)));
+          stable_rounds = moved <= options.termination_mean_tolerance * size ?
+            stable_rounds + 1 : 0;
+          if (stable_rounds >= options.termination_stable_rounds) {
+            converged = true;
+          }
+        }
+        if (converged) {
+          if (options.verbose) printf("Early termination.\n");
+          break;
+        }
       
-      control.Switch();
+        control.Switch();
       
-    }  // for round
+      }  // for round
+
+      if (nullptr != final_energy) *final_energy = energy;
+    }
+  }  // namespace
+
+  // Warm-started PatchMatch: every target patch first tries the
+  // transform it had in `initialization` (e.g. the previous video
+  // frame's result), then options.initial_candidates random ones. When
+  // energy is given, it receives the energy of the returned map, which
+  // comes for free and equals what GetEnergy would compute.
+  //
+  // PatchMatchInto builds the map in workspace->result and returns a
+  // reference to it, valid until the workspace is used again;
+  // initialization may be that same map. PatchMatch below returns the
+  // map itself.
+  //
+  // When source was built with regions, initialization, random search
+  // and propagation only ever match to its valid blocks.
+  template <typename DataType, typename Distance = algebra::L2>
+  const TransformMap &PatchMatchInto(
+      const BlockFeatureImage<DataType> &source,
+      const BlockFeatureImage<DataType> &target,
+      PatchMatchOptions options,
+      const TransformMap *initialization,
+      PatchMatchWorkspace *workspace,
+      double *energy = nullptr) {
+
+    if (source.dimension != target.dimension) {
+      printf("[ERROR] dimension mismatch between source and target.");
+      exit(-1);
+    }
+    if (nullptr != initialization &&
+        (initialization->height != target.height ||
+         initialization->width != target.width)) {
+      printf("[ERROR] initialization does not match the target size.");
+      exit(-1);
+    }
+    if (nullptr != source.regions() && 0 == source.regions()->area()) {
+      printf("[ERROR] no source region holds a whole block.");
+      exit(-1);
+    }
+    if (options.observer) {
+      Solve<DataType, Distance, true>(source, target, options,
+                                      initialization, workspace, energy);
+    } else {
+      Solve<DataType, Distance, false>(source, target, options,
+                                       initialization, workspace, energy);
+    }
+    return workspace->result;
+  }
 
-    return result;
+  template <typename DataType, typename Distance = algebra::L2>
+  TransformMap PatchMatch(const BlockFeatureImage<DataType> &source, 
+                          const BlockFeatureImage<DataType> &target,
+                          PatchMatchOptions options,
+                          const TransformMap *initialization,
+                          double *energy = nullptr) {
+    PatchMatchWorkspace workspace;
+    PatchMatchInto<DataType, Distance>(source, target, options,
+                                       initialization, &workspace, energy);
+    return std::move(workspace.result);
+  }
+
+  template <typename DataType, typename Distance = algebra::L2>
+  TransformMap PatchMatch(const BlockFeatureImage<DataType> &source, 
+                          const BlockFeatureImage<DataType> &target,
+                          PatchMatchOptions options) {
+    return PatchMatch<DataType, Distance>(source, target, options, nullptr);
+  }
+
+  // The average translation over the whole map, i.e. where the target
+  // as a whole lands in the source.
+  inline Transform MeanTransform(const TransformMap &map) {
+    Transform mean;
+    long long y = 0;
+    long long x = 0;
+    for (int i = 0; i < map.height; ++i) {
+      for (int j = 0; j < map.width; ++j) {
+        y += map.Get(i, j).y;
+        x += map.Get(i, j).x;
+      }
+    }
+    if (map.height * map.width > 0) {
+      mean.y = static_cast<int>(y / (map.height * map.width));
+      mean.x = static_cast<int>(x / (map.height * map.width));
+    }
+    return mean;
   }
   
 }  // namespace icon_fitter
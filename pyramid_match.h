@@ -0,0 +1,182 @@
+#ifndef _ICON_FITTER_PYRAMID_MATCH_
+#define _ICON_FITTER_PYRAMID_MATCH_
+
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <vector>
+
+#include "opencv2/imgproc.hpp"
+
+#include "algebra.h"
+#include "feature_image.h"
+#include "hog.h"
+#include "patchmatch.h"
+
+namespace icon_fitter {
+
+  struct PyramidMatchOptions {
+    HogOptions hog {6, 9, false};
+    int block_size = 3;
+    int stride = 6;
+
+    // Size ratio between consecutive levels, and the most levels to
+    // build. Fewer are built when the template would become smaller
+    // than one block.
+    double shrink_rate = 0.5;
+    int levels = 3;
+
+    // Solver for the coarsest level.
+    PatchMatchOptions coarse;
+    // Solver for every finer level, seeded from the level above.
+    PatchMatchOptions fine;
+
+    PyramidMatchOptions() {
+      coarse.iterations = 10;
+      coarse.initial_candidates = 20;
+      coarse.verbose = false;
+      fine.iterations = 3;
+      fine.initial_candidates = 0;
+      fine.max_search_radius = 4.0;
+      fine.verbose = false;
+    }
+  };
+
+  // HOG block features of an image at successively smaller scales.
+  // Level 0 is the input resolution.
+  class FeaturePyramid {
+  public:
+    FeaturePyramid(const cv::Mat &image, int levels,
+                   const PyramidMatchOptions &options,
+                   BlockStorage storage = BLOCK_LAZY) {
+      cv::Mat current = image;
+      for (int l = 0; l < levels; ++l) {
+        if (l > 0) {
+          cv::Mat smaller;
+          cv::resize(current, smaller,
+                     cv::Size(cvRound(image.cols * pow(options.shrink_rate, l)),
+                              cvRound(image.rows * pow(options.shrink_rate, l))),
+                     0, 0, cv::INTER_AREA);
+          current = smaller;
+        }
+        sizes_.push_back(current.size());
+        features_.emplace_back(new FeatureImage<float>(
+            HogGen::Create(current, options.hog)));
+        blocks_.emplace_back(new BlockFeatureImage<float>(
+            features_.back().get(), options.block_size, options.stride,
+            storage));
+      }
+    }
+
+    int levels() const {
+      return static_cast<int>(blocks_.size());
+    }
+
+    const BlockFeatureImage<float> &level(int id) const {
+      return *blocks_[id];
+    }
+
+    // Pixel size of the image the level was computed from.
+    const cv::Size &size(int id) const {
+      return sizes_[id];
+    }
+
+    // How many levels an image of this size supports before its block
+    // grid disappears.
+    static int MaxLevels(const cv::Size &size,
+                         const PyramidMatchOptions &options) {
+      int extent = (options.block_size - 1) * options.stride + 1;
+      int levels = 0;
+      double scale = 1.0;
+      while (levels < options.levels &&
+             cvRound(size.width * scale) >= extent &&
+             cvRound(size.height * scale) >= extent) {
+        ++levels;
+        scale *= options.shrink_rate;
+      }
+      return levels;
+    }
+
+  private:
+    std::vector<cv::Size> sizes_;
+    std::vector<std::unique_ptr<FeatureImage<float> > > features_;
+    std::vector<std::unique_ptr<BlockFeatureImage<float> > > blocks_;
+  };
+
+  // Carries a map solved between coarse target and source images to
+  // the next finer level. Every fine target patch takes the
+  // displacement of the nearest coarse patch, applies it at its own
+  // position scaled down to the coarse level, and scales the resulting
+  // source location back up to fine coordinates.
+  inline TransformMap UpsampleTransformMap(const TransformMap &coarse,
+                                           const cv::Size &coarse_target,
+                                           const cv::Size &fine_target,
+                                           const cv::Size &coarse_source,
+                                           const cv::Size &fine_source,
+                                           int height, int width) {
+    double target_y = static_cast<double>(coarse_target.height) /
+      fine_target.height;
+    double target_x = static_cast<double>(coarse_target.width) /
+      fine_target.width;
+    double source_y = static_cast<double>(fine_source.height) /
+      coarse_source.height;
+    double source_x = static_cast<double>(fine_source.width) /
+      coarse_source.width;
+
+    TransformMap fine(height, width);
+    if (0 == coarse.height * coarse.width) return fine;
+    for (int i = 0; i < height; ++i) {
+      double y = i * target_y;
+      int ci = std::min(static_cast<int>(y), coarse.height - 1);
+      for (int j = 0; j < width; ++j) {
+        double x = j * target_x;
+        int cj = std::min(static_cast<int>(x), coarse.width - 1);
+        const Transform &delta = coarse.Get(ci, cj);
+        Transform &result = fine(i, j);
+        result.y = cvRound((y + delta.y) * source_y) - i;
+        result.x = cvRound((x + delta.x) * source_x) - j;
+      }
+    }
+    return fine;
+  }
+
+  // Coarse-to-fine PatchMatch: the coarsest level is solved from
+  // scratch, and every finer level only refines the upsampled map of
+  // the level above within options.fine.max_search_radius.
+  template <typename Distance = algebra::L2>
+  TransformMap PyramidPatchMatch(const FeaturePyramid &source,
+                                 const FeaturePyramid &target,
+                                 const PyramidMatchOptions &options) {
+    int levels = std::min(source.levels(), target.levels());
+    if (0 == levels) {
+      return TransformMap(0, 0);
+    }
+    int top = levels - 1;
+    TransformMap result = PatchMatch<float, Distance>(
+        source.level(top), target.level(top), options.coarse);
+    for (int l = top - 1; l >= 0; --l) {
+      TransformMap seed = UpsampleTransformMap(
+          result, target.size(l + 1), target.size(l),
+          source.size(l + 1), source.size(l),
+          target.level(l).height, target.level(l).width);
+      result = PatchMatch<float, Distance>(source.level(l), target.level(l),
+                                           options.fine, &seed);
+    }
+    return result;
+  }
+
+  template <typename Distance = algebra::L2>
+  TransformMap PyramidPatchMatch(const cv::Mat &source_image,
+                                 const cv::Mat &target_image,
+                                 const PyramidMatchOptions &options) {
+    int levels = std::min(
+        FeaturePyramid::MaxLevels(source_image.size(), options),
+        FeaturePyramid::MaxLevels(target_image.size(), options));
+    FeaturePyramid source(source_image, levels, options);
+    FeaturePyramid target(target_image, levels, options, BLOCK_MATERIALIZED);
+    return PyramidPatchMatch<Distance>(source, target, options);
+  }
+
+}  // namespace icon_fitter
+
+#endif  // _ICON_FITTER_PYRAMID_MATCH_
@@ -0,0 +1,832 @@
+#ifndef _ICON_FITTER_SIMD_DISTANCE_
+#define _ICON_FITTER_SIMD_DISTANCE_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define ICON_FITTER_X86 1
+#include <immintrin.h>
+#endif
+
+#include "algebra.h"
+#include "feature_image.h"
+
+namespace icon_fitter {
+  namespace algebra {
+    namespace simd {
+
+      // ---------- Instruction Set Selection ----------
+
+      enum SimdIsa {
+        SIMD_SCALAR = 0,
+        SIMD_SSE4,
+        SIMD_AVX2,
+      };
+
+      // The best instruction set supported by the running CPU. Setting
+      // ICON_FITTER_ISA to "scalar" or "sse4" caps it, which is handy
+      // when comparing kernels.
+      inline SimdIsa DetectIsa() {
+        SimdIsa isa = SIMD_SCALAR;
+#ifdef ICON_FITTER_X86
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+          isa = SIMD_AVX2;
+        } else if (__builtin_cpu_supports("sse4.1")) {
+          isa = SIMD_SSE4;
+        }
+#endif
+        const char *cap = getenv("ICON_FITTER_ISA");
+        if (nullptr != cap) {
+          if (0 == strcmp(cap, "scalar")) {
+            isa = SIMD_SCALAR;
+          } else if (0 == strcmp(cap, "sse4") && SIMD_SSE4 < isa) {
+            isa = SIMD_SSE4;
+          }
+        }
+        return isa;
+      }
+
+      inline SimdIsa ActiveIsa() {
+        static const SimdIsa isa = DetectIsa();
+        return isa;
+      }
+
+      inline const char *IsaName(SimdIsa isa) {
+        switch (isa) {
+        case SIMD_AVX2: return "avx2";
+        case SIMD_SSE4: return "sse4";
+        default: return "scalar";
+        }
+      }
+
+      // ---------- Kernels ----------
+      // A kernel walks two vectors laid out as `runs` contiguous runs
+      // of `length` floats, run k starting at a + a_offsets[k] (resp. b
+      // + b_offsets[k]), and accumulates up to three sums. Each Op
+      // supplies the per-element update for every instruction set.
+      //
+      // Every kernel also takes kRuns and kLength, which when non-zero
+      // replace runs and length by compile-time constants so that the
+      // loops unroll completely (see Fixed Configuration).
+
+      typedef void (*Kernel)(const float *a, const int *a_offsets,
+                             const float *b, const int *b_offsets,
+                             int runs, int length, float *sums);
+
+      template <typename Op, int kRuns = 0, int kLength = 0>
+      void ScalarKernel(const float *a, const int *a_offsets,
+                        const float *b, const int *b_offsets,
+                        int runs, int length, float *sums) {
+        if (kRuns > 0) runs = kRuns;
+        if (kLength > 0) length = kLength;
+        sums[0] = sums[1] = sums[2] = 0.0f;
+        for (int r = 0; r < runs; ++r) {
+          const float *pa = a + a_offsets[r];
+          const float *pb = b + b_offsets[r];
+          for (int k = 0; k < length; ++k) {
+            Op::Scalar(pa[k], pb[k], sums);
+          }
+        }
+      }
+
+#ifdef ICON_FITTER_X86
+
+      __attribute__((target("sse4.1")))
+      inline float HorizontalSum(__m128 x) {
+        x = _mm_add_ps(x, _mm_movehl_ps(x, x));
+        x = _mm_add_ss(x, _mm_shuffle_ps(x, x, 1));
+        return _mm_cvtss_f32(x);
+      }
+
+      __attribute__((target("avx2,fma")))
+      inline float HorizontalSum(__m256 x) {
+        __m128 half = _mm_add_ps(_mm256_castps256_ps128(x),
+                                 _mm256_extractf128_ps(x, 1));
+        half = _mm_add_ps(half, _mm_movehl_ps(half, half));
+        half = _mm_add_ss(half, _mm_shuffle_ps(half, half, 1));
+        return _mm_cvtss_f32(half);
+      }
+
+      template <typename Op, int kRuns = 0, int kLength = 0>
+      __attribute__((target("sse4.1")))
+      void Sse4Kernel(const float *a, const int *a_offsets,
+                      const float *b, const int *b_offsets,
+                      int runs, int length, float *sums) {
+        if (kRuns > 0) runs = kRuns;
+        if (kLength > 0) length = kLength;
+        __m128 acc[3] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+        float tail[3] = {0.0f, 0.0f, 0.0f};
+        int body = length & ~3;
+        for (int r = 0; r < runs; ++r) {
+          const float *pa = a + a_offsets[r];
+          const float *pb = b + b_offsets[r];
+          for (int k = 0; k < body; k += 4) {
+            Op::Sse4(_mm_loadu_ps(pa + k), _mm_loadu_ps(pb + k), acc);
+          }
+          for (int k = body; k < length; ++k) {
+            Op::Scalar(pa[k], pb[k], tail);
+          }
+        }
+        for (int s = 0; s < 3; ++s) {
+          sums[s] = HorizontalSum(acc[s]) + tail[s];
+        }
+      }
+
+      // The ragged end of every run is read with a masked load, so
+      // lanes past the run contribute zeros. Vectors alternate between
+      // two sets of accumulators, which halves the chain of dependent
+      // adds that bounds short, fully unrolled walks.
+      template <typename Op, int kRuns = 0, int kLength = 0>
+      __attribute__((target("avx2,fma")))
+      void Avx2Kernel(const float *a, const int *a_offsets,
+                      const float *b, const int *b_offsets,
+                      int runs, int length, float *sums) {
+        if (kRuns > 0) runs = kRuns;
+        if (kLength > 0) length = kLength;
+        __m256 acc[3] = {_mm256_setzero_ps(), _mm256_setzero_ps(),
+                         _mm256_setzero_ps()};
+        __m256 spare[3] = {_mm256_setzero_ps(), _mm256_setzero_ps(),
+                           _mm256_setzero_ps()};
+        int body = length & ~7;
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(length - body),
+                                          _mm256_setr_epi32(0, 1, 2, 3,
+                                                            4, 5, 6, 7));
+        for (int r = 0; r < runs; ++r) {
+          const float *pa = a + a_offsets[r];
+          const float *pb = b + b_offsets[r];
+          int k = 0;
+          for (; k + 16 <= body; k += 16) {
+            Op::Avx2(_mm256_loadu_ps(pa + k), _mm256_loadu_ps(pb + k), acc);
+            Op::Avx2(_mm256_loadu_ps(pa + k + 8), _mm256_loadu_ps(pb + k + 8),
+                     spare);
+          }
+          if (k < body) {
+            Op::Avx2(_mm256_loadu_ps(pa + k), _mm256_loadu_ps(pb + k), acc);
+          }
+          if (body < length) {
+            Op::Avx2(_mm256_maskload_ps(pa + body, mask),
+                     _mm256_maskload_ps(pb + body, mask), spare);
+          }
+        }
+        for (int s = 0; s < 3; ++s) {
+          sums[s] = HorizontalSum(_mm256_add_ps(acc[s], spare[s]));
+        }
+      }
+
+#endif  // ICON_FITTER_X86
+
+      template <typename Op, int kRuns = 0, int kLength = 0>
+      inline Kernel SelectKernel(SimdIsa isa) {
+#ifdef ICON_FITTER_X86
+        if (SIMD_AVX2 == isa) return Avx2Kernel<Op, kRuns, kLength>;
+        if (SIMD_SSE4 == isa) return Sse4Kernel<Op, kRuns, kLength>;
+#endif
+        return ScalarKernel<Op, kRuns, kLength>;
+      }
+
+      // ---------- Bounded Kernels ----------
+      // For Ops that only accumulate non-negative terms into sums[0].
+      // The running sum is checked against bound about every
+      // kBoundCheck elements (inside long runs, or at the end of the
+      // run that crosses the mark for short ones), and the kernel
+      // returns as soon as it is reached. Kernels that run to the end
+      // return exactly what the unbounded kernel would.
+
+      typedef float (*BoundedKernel)(const float *a, const int *a_offsets,
+                                     const float *b, const int *b_offsets,
+                                     int runs, int length, float bound);
+
+      constexpr int kBoundCheck = 32;
+
+      template <typename Op, int kRuns = 0, int kLength = 0>
+      float ScalarBoundedKernel(const float *a, const int *a_offsets,
+                                const float *b, const int *b_offsets,
+                                int runs, int length, float bound) {
+        if (kRuns > 0) runs = kRuns;
+        if (kLength > 0) length = kLength;
+        float sums[3] = {0.0f, 0.0f, 0.0f};
+        int pending = 0;
+        for (int r = 0; r < runs; ++r) {
+          const float *pa = a + a_offsets[r];
+          const float *pb = b + b_offsets[r];
+          for (int k = 0; k < length; ++k) {
+            Op::Scalar(pa[k], pb[k], sums);
+          }
+          pending += length;
+          if (pending >= kBoundCheck) {
+            if (sums[0] >= bound) break;
+            pending = 0;
+          }
+        }
+        return sums[0];
+      }
+
+#ifdef ICON_FITTER_X86
+
+      template <typename Op, int kRuns = 0, int kLength = 0>
+      __attribute__((target("sse4.1")))
+      float Sse4BoundedKernel(const float *a, const int *a_offsets,
+                              const float *b, const int *b_offsets,
+                              int runs, int length, float bound) {
+        if (kRuns > 0) runs = kRuns;
+        if (kLength > 0) length = kLength;
+        __m128 acc[3] = {_mm_setzero_ps(), _mm_setzero_ps(), _mm_setzero_ps()};
+        float tail[3] = {0.0f, 0.0f, 0.0f};
+        int body = length & ~3;
+        int pending = 0;
+        for (int r = 0; r < runs; ++r) {
+          const float *pa = a + a_offsets[r];
+          const float *pb = b + b_offsets[r];
+          for (int k = 0; k < body; k += 4) {
+            Op::Sse4(_mm_loadu_ps(pa + k), _mm_loadu_ps(pb + k), acc);
+            if (0 == (k + 4) % kBoundCheck && k + 4 < length &&
+                HorizontalSum(acc[0]) + tail[0] >= bound) {
+              return HorizontalSum(acc[0]) + tail[0];
+            }
+          }
+          for (int k = body; k < length; ++k) {
+            Op::Scalar(pa[k], pb[k], tail);
+          }
+          pending += length;
+          if (pending >= kBoundCheck) {
+            float sum = HorizontalSum(acc[0]) + tail[0];
+            if (sum >= bound) return sum;
+            pending = 0;
+          }
+        }
+        return HorizontalSum(acc[0]) + tail[0];
+      }
+
+      template <typename Op, int kRuns = 0, int kLength = 0>
+      __attribute__((target("avx2,fma")))
+      float Avx2BoundedKernel(const float *a, const int *a_offsets,
+                              const float *b, const int *b_offsets,
+                              int runs, int length, float bound) {
+        if (kRuns > 0) runs = kRuns;
+        if (kLength > 0) length = kLength;
+        // Two sets of accumulators, as in Avx2Kernel.
+        __m256 acc[3] = {_mm256_setzero_ps(), _mm256_setzero_ps(),
+                         _mm256_setzero_ps()};
+        __m256 spare[3] = {_mm256_setzero_ps(), _mm256_setzero_ps(),
+                           _mm256_setzero_ps()};
+        int body = length & ~7;
+        __m256i mask = _mm256_cmpgt_epi32(_mm256_set1_epi32(length - body),
+                                          _mm256_setr_epi32(0, 1, 2, 3,
+                                                            4, 5, 6, 7));
+        int pending = 0;
+        for (int r = 0; r < runs; ++r) {
+          const float *pa = a + a_offsets[r];
+          const float *pb = b + b_offsets[r];
+          int k = 0;
+          for (; k + 16 <= body; k += 16) {
+            Op::Avx2(_mm256_loadu_ps(pa + k), _mm256_loadu_ps(pb + k), acc);
+            Op::Avx2(_mm256_loadu_ps(pa + k + 8), _mm256_loadu_ps(pb + k + 8),
+                     spare);
+            if (0 == (k + 16) % kBoundCheck && k + 16 < length) {
+              float sum = HorizontalSum(_mm256_add_ps(acc[0], spare[0]));
+              if (sum >= bound) return sum;
+            }
+          }
+          if (k < body) {
+            Op::Avx2(_mm256_loadu_ps(pa + k), _mm256_loadu_ps(pb + k), acc);
+          }
+          if (body < length) {
+            Op::Avx2(_mm256_maskload_ps(pa + body, mask),
+                     _mm256_maskload_ps(pb + body, mask), spare);
+          }
+          pending += length;
+          if (pending >= kBoundCheck) {
+            float sum = HorizontalSum(_mm256_add_ps(acc[0], spare[0]));
+            if (sum >= bound) return sum;
+            pending = 0;
+          }
+        }
+        return HorizontalSum(_mm256_add_ps(acc[0], spare[0]));
+      }
+
+#endif  // ICON_FITTER_X86
+
+      template <typename Op, int kRuns = 0, int kLength = 0>
+      inline BoundedKernel SelectBoundedKernel(SimdIsa isa) {
+#ifdef ICON_FITTER_X86
+        if (SIMD_AVX2 == isa) return Avx2BoundedKernel<Op, kRuns, kLength>;
+        if (SIMD_SSE4 == isa) return Sse4BoundedKernel<Op, kRuns, kLength>;
+#endif
+        return ScalarBoundedKernel<Op, kRuns, kLength>;
+      }
+
+      // One Op's kernels for any shape and for the two layouts of the
+      // fixed configuration: kFixedRuns runs of kFixedBins, and a
+      // single materialized run.
+      constexpr int kFixedRuns = kFixedBlockSize * kFixedBlockSize;
+
+      template <typename KernelType>
+      struct KernelSet {
+        KernelType generic;
+        KernelType fixed_runs;
+        KernelType fixed_padded;
+
+        template <typename DataType>
+        inline KernelType Pick(const Patch<DataType> &a,
+                               bool contiguous) const {
+          if (contiguous) {
+            return FixedPaddedDimension(sizeof(DataType)) == a.padded_size() ?
+              fixed_padded : generic;
+          }
+          return kFixedRuns == a.runs() && kFixedBins == a.run_length() ?
+            fixed_runs : generic;
+        }
+      };
+
+      // Two materialized patches are compared as one padded run (the
+      // zero padding contributes nothing to any Op); otherwise both are
+      // walked run by run.
+      template <typename Op>
+      inline void Run(const Patch<float> &a, const Patch<float> &b,
+                      float *sums) {
+        static const KernelSet<Kernel> kernels {
+          SelectKernel<Op>(ActiveIsa()),
+          SelectKernel<Op, kFixedRuns, kFixedBins>(ActiveIsa()),
+          SelectKernel<Op, 1, FixedPaddedDimension(sizeof(float))>(
+              ActiveIsa())};
+        static const int origin = 0;
+        if (a.contiguous() && b.contiguous()) {
+          kernels.Pick(a, true)(a.data(), &origin, b.data(), &origin,
+                                1, a.padded_size(), sums);
+          return;
+        }
+        kernels.Pick(a, false)(a.begin(), a.run_offsets(), b.begin(),
+                               b.run_offsets(), a.runs(), a.run_length(),
+                               sums);
+      }
+
+      template <typename Op>
+      inline float RunBounded(const Patch<float> &a, const Patch<float> &b,
+                              double bound) {
+        static const KernelSet<BoundedKernel> kernels {
+          SelectBoundedKernel<Op>(ActiveIsa()),
+          SelectBoundedKernel<Op, kFixedRuns, kFixedBins>(ActiveIsa()),
+          SelectBoundedKernel<Op, 1, FixedPaddedDimension(sizeof(float))>(
+              ActiveIsa())};
+        static const int origin = 0;
+        float limit = bound < std::numeric_limits<float>::max() ?
+          static_cast<float>(bound) : std::numeric_limits<float>::infinity();
+        if (a.contiguous() && b.contiguous()) {
+          return kernels.Pick(a, true)(a.data(), &origin, b.data(), &origin,
+                                       1, a.padded_size(), limit);
+        }
+        return kernels.Pick(a, false)(a.begin(), a.run_offsets(), b.begin(),
+                                      b.run_offsets(), a.runs(),
+                                      a.run_length(), limit);
+      }
+
+      // ---------- Byte Kernels ----------
+      // The same walk over quantized (uint8_t) patches, with exact
+      // integer sums. Vector lanes take 16 or 32 bytes at a time, four
+      // times the elements of a float lane; run ends shorter than that
+      // are finished in scalar code. Materialized patches are padded
+      // to a multiple of 32 bytes, so they never take the scalar path.
+      // Sums are 32 bit, which holds (255^2 per element) for up to
+      // 33000 elements.
+
+      typedef int32_t (*ByteKernel)(const uint8_t *a, const int *a_offsets,
+                                    const uint8_t *b, const int *b_offsets,
+                                    int runs, int length);
+
+      template <typename Op, int kRuns = 0, int kLength = 0>
+      int32_t ScalarByteKernel(const uint8_t *a, const int *a_offsets,
+                               const uint8_t *b, const int *b_offsets,
+                               int runs, int length) {
+        if (kRuns > 0) runs = kRuns;
+        if (kLength > 0) length = kLength;
+        int32_t sum = 0;
+        for (int r = 0; r < runs; ++r) {
+          const uint8_t *pa = a + a_offsets[r];
+          const uint8_t *pb = b + b_offsets[r];
+          for (int k = 0; k < length; ++k) {
+            sum += Op::Scalar(pa[k], pb[k]);
+          }
+        }
+        return sum;
+      }
+
+#ifdef ICON_FITTER_X86
+
+      __attribute__((target("sse4.1")))
+      inline int32_t HorizontalSum(__m128i x) {
+        x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(1, 0, 3, 2)));
+        x = _mm_add_epi32(x, _mm_shuffle_epi32(x, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(x);
+      }
+
+      template <typename Op, int kRuns = 0, int kLength = 0>
+      __attribute__((target("sse4.1")))
+      int32_t Sse4ByteKernel(const uint8_t *a, const int *a_offsets,
+                             const uint8_t *b, const int *b_offsets,
+                             int runs, int length) {
+        if (kRuns > 0) runs = kRuns;
+        if (kLength > 0) length = kLength;
+        __m128i acc = _mm_setzero_si128();
+        int32_t tail = 0;
+        int body = length & ~15;
+        for (int r = 0; r < runs; ++r) {
+          const uint8_t *pa = a + a_offsets[r];
+          const uint8_t *pb = b + b_offsets[r];
+          for (int k = 0; k < body; k += 16) {
+            acc = _mm_add_epi32(acc, Op::Sse4(
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(pa + k)),
+                _mm_loadu_si128(reinterpret_cast<const __m128i*>(pb + k))));
+          }
+          for (int k = body; k < length; ++k) {
+            tail += Op::Scalar(pa[k], pb[k]);
+          }
+        }
+        return HorizontalSum(acc) + tail;
+      }
+
+      template <typename Op, int kRuns = 0, int kLength = 0>
+      __attribute__((target("avx2,fma")))
+      int32_t Avx2ByteKernel(const uint8_t *a, const int *a_offsets,
+                             const uint8_t *b, const int *b_offsets,
+                             int runs, int length) {
+        if (kRuns > 0) runs = kRuns;
+        if (kLength > 0) length = kLength;
+        __m256i acc = _mm256_setzero_si256();
+        int32_t tail = 0;
+        int body = length & ~31;
+        for (int r = 0; r < runs; ++r) {
+          const uint8_t *pa = a + a_offsets[r];
+          const uint8_t *pb = b + b_offsets[r];
+          for (int k = 0; k < body; k += 32) {
+            acc = _mm256_add_epi32(acc, Op::Avx2(
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pa + k)),
+                _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pb + k))));
+          }
+          for (int k = body; k < length; ++k) {
+            tail += Op::Scalar(pa[k], pb[k]);
+          }
+        }
+        __m128i half = _mm_add_epi32(_mm256_castsi256_si128(acc),
+                                     _mm256_extracti128_si256(acc, 1));
+        half = _mm_add_epi32(half, _mm_shuffle_epi32(half,
+                                                     _MM_SHUFFLE(1, 0, 3, 2)));
+        half = _mm_add_epi32(half, _mm_shuffle_epi32(half,
+                                                     _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(half) + tail;
+      }
+
+#endif  // ICON_FITTER_X86
+
+      template <typename Op, int kRuns = 0, int kLength = 0>
+      inline ByteKernel SelectByteKernel(SimdIsa isa) {
+#ifdef ICON_FITTER_X86
+        if (SIMD_AVX2 == isa) return Avx2ByteKernel<Op, kRuns, kLength>;
+        if (SIMD_SSE4 == isa) return Sse4ByteKernel<Op, kRuns, kLength>;
+#endif
+        return ScalarByteKernel<Op, kRuns, kLength>;
+      }
+
+      template <typename Op>
+      inline int32_t RunBytes(const Patch<uint8_t> &a,
+                              const Patch<uint8_t> &b) {
+        static const KernelSet<ByteKernel> kernels {
+          SelectByteKernel<Op>(ActiveIsa()),
+          SelectByteKernel<Op, kFixedRuns, kFixedBins>(ActiveIsa()),
+          SelectByteKernel<Op, 1, FixedPaddedDimension(sizeof(uint8_t))>(
+              ActiveIsa())};
+        static const int origin = 0;
+        if (a.contiguous() && b.contiguous()) {
+          return kernels.Pick(a, true)(a.data(), &origin, b.data(), &origin,
+                                       1, a.padded_size());
+        }
+        return kernels.Pick(a, false)(a.begin(), a.run_offsets(), b.begin(),
+                                      b.run_offsets(), a.runs(),
+                                      a.run_length());
+      }
+
+      // Byte operations return the vector of partial int32 sums for a
+      // whole register.
+
+      struct ByteSquaredDifferenceOp {
+        static inline int32_t Scalar(uint8_t a, uint8_t b) {
+          int32_t d = static_cast<int32_t>(a) - b;
+          return d * d;
+        }
+#ifdef ICON_FITTER_X86
+        // Widened to 16 bits, then squared and pairwise added by madd.
+        __attribute__((target("sse4.1")))
+        static inline __m128i Sse4(__m128i a, __m128i b) {
+          __m128i low = _mm_sub_epi16(_mm_cvtepu8_epi16(a),
+                                      _mm_cvtepu8_epi16(b));
+          __m128i high = _mm_sub_epi16(
+              _mm_cvtepu8_epi16(_mm_srli_si128(a, 8)),
+              _mm_cvtepu8_epi16(_mm_srli_si128(b, 8)));
+          return _mm_add_epi32(_mm_madd_epi16(low, low),
+                               _mm_madd_epi16(high, high));
+        }
+        __attribute__((target("avx2,fma")))
+        static inline __m256i Avx2(__m256i a, __m256i b) {
+          __m256i low = _mm256_sub_epi16(
+              _mm256_cvtepu8_epi16(_mm256_castsi256_si128(a)),
+              _mm256_cvtepu8_epi16(_mm256_castsi256_si128(b)));
+          __m256i high = _mm256_sub_epi16(
+              _mm256_cvtepu8_epi16(_mm256_extracti128_si256(a, 1)),
+              _mm256_cvtepu8_epi16(_mm256_extracti128_si256(b, 1)));
+          return _mm256_add_epi32(_mm256_madd_epi16(low, low),
+                                  _mm256_madd_epi16(high, high));
+        }
+#endif
+      };
+
+      struct ByteAbsoluteDifferenceOp {
+        static inline int32_t Scalar(uint8_t a, uint8_t b) {
+          return a > b ? a - b : b - a;
+        }
+#ifdef ICON_FITTER_X86
+        // psadbw leaves one sum per 8 bytes in the low bits of each
+        // 64 bit lane, with zeros above.
+        __attribute__((target("sse4.1")))
+        static inline __m128i Sse4(__m128i a, __m128i b) {
+          return _mm_sad_epu8(a, b);
+        }
+        __attribute__((target("avx2,fma")))
+        static inline __m256i Avx2(__m256i a, __m256i b) {
+          return _mm256_sad_epu8(a, b);
+        }
+#endif
+      };
+
+      // ---------- Element Operations ----------
+
+      struct SquaredDifferenceOp {
+        static inline void Scalar(float a, float b, float *sums) {
+          float d = a - b;
+          sums[0] += d * d;
+        }
+#ifdef ICON_FITTER_X86
+        __attribute__((target("sse4.1")))
+        static inline void Sse4(__m128 a, __m128 b, __m128 *acc) {
+          __m128 d = _mm_sub_ps(a, b);
+          acc[0] = _mm_add_ps(acc[0], _mm_mul_ps(d, d));
+        }
+        __attribute__((target("avx2,fma")))
+        static inline void Avx2(__m256 a, __m256 b, __m256 *acc) {
+          __m256 d = _mm256_sub_ps(a, b);
+          acc[0] = _mm256_fmadd_ps(d, d, acc[0]);
+        }
+#endif
+      };
+
+      struct AbsoluteDifferenceOp {
+        static inline void Scalar(float a, float b, float *sums) {
+          sums[0] += fabsf(a - b);
+        }
+#ifdef ICON_FITTER_X86
+        __attribute__((target("sse4.1")))
+        static inline void Sse4(__m128 a, __m128 b, __m128 *acc) {
+          __m128 sign = _mm_set1_ps(-0.0f);
+          acc[0] = _mm_add_ps(acc[0], _mm_andnot_ps(sign, _mm_sub_ps(a, b)));
+        }
+        __attribute__((target("avx2,fma")))
+        static inline void Avx2(__m256 a, __m256 b, __m256 *acc) {
+          __m256 sign = _mm256_set1_ps(-0.0f);
+          acc[0] = _mm256_add_ps(acc[0],
+                                 _mm256_andnot_ps(sign, _mm256_sub_ps(a, b)));
+        }
+#endif
+      };
+
+      // sums = {a . b, a . a, b . b}
+      struct DotOp {
+        static inline void Scalar(float a, float b, float *sums) {
+          sums[0] += a * b;
+          sums[1] += a * a;
+          sums[2] += b * b;
+        }
+#ifdef ICON_FITTER_X86
+        __attribute__((target("sse4.1")))
+        static inline void Sse4(__m128 a, __m128 b, __m128 *acc) {
+          acc[0] = _mm_add_ps(acc[0], _mm_mul_ps(a, b));
+          acc[1] = _mm_add_ps(acc[1], _mm_mul_ps(a, a));
+          acc[2] = _mm_add_ps(acc[2], _mm_mul_ps(b, b));
+        }
+        __attribute__((target("avx2,fma")))
+        static inline void Avx2(__m256 a, __m256 b, __m256 *acc) {
+          acc[0] = _mm256_fmadd_ps(a, b, acc[0]);
+          acc[1] = _mm256_fmadd_ps(a, a, acc[1]);
+          acc[2] = _mm256_fmadd_ps(b, b, acc[2]);
+        }
+#endif
+      };
+
+      // (a - b)^2 / (a + b), where a + b > 0 (histogram entries are
+      // non-negative, so empty bins contribute nothing).
+      struct ChiSquaredOp {
+        static inline void Scalar(float a, float b, float *sums) {
+          float s = a + b;
+          if (s > 0.0f) {
+            float d = a - b;
+            sums[0] += d * d / s;
+          }
+        }
+#ifdef ICON_FITTER_X86
+        __attribute__((target("sse4.1")))
+        static inline void Sse4(__m128 a, __m128 b, __m128 *acc) {
+          __m128 s = _mm_add_ps(a, b);
+          __m128 d = _mm_sub_ps(a, b);
+          __m128 valid = _mm_cmpgt_ps(s, _mm_setzero_ps());
+          __m128 q = _mm_div_ps(_mm_mul_ps(d, d), s);
+          acc[0] = _mm_add_ps(acc[0], _mm_and_ps(valid, q));
+        }
+        __attribute__((target("avx2,fma")))
+        static inline void Avx2(__m256 a, __m256 b, __m256 *acc) {
+          __m256 s = _mm256_add_ps(a, b);
+          __m256 d = _mm256_sub_ps(a, b);
+          __m256 valid = _mm256_cmp_ps(s, _mm256_setzero_ps(), _CMP_GT_OQ);
+          __m256 q = _mm256_div_ps(_mm256_mul_ps(d, d), s);
+          acc[0] = _mm256_add_ps(acc[0], _mm256_and_ps(valid, q));
+        }
+#endif
+      };
+
+      // ---------- Distance Functors ----------
+      // Drop-in replacements for algebra::L2 as the Distance parameter
+      // of PatchMatch. Float patches, and quantized ones for L2 and L1,
+      // take the vectorized path, anything else falls back to a scalar
+      // loop over operator[].
+      //
+      // ComputeBounded (see algebra::BoundedDistance) first tries a
+      // lower bound from the precomputed patch sums and norms, and
+      // only then runs the bounded kernel.
+
+      struct L2 {
+        template <typename VectorType>
+        static double Compute(const VectorType &a, const VectorType &b) {
+          return algebra::L2::Compute(a, b);
+        }
+
+        static double Compute(const Patch<float> &a, const Patch<float> &b) {
+          float sums[3];
+          Run<SquaredDifferenceOp>(a, b, sums);
+          return sums[0];
+        }
+
+        template <typename VectorType>
+        static double ComputeBounded(const VectorType &a, const VectorType &b,
+                                     double bound) {
+          return algebra::L2::ComputeBounded(a, b, bound);
+        }
+
+        // |a - b|^2 >= (|a| - |b|)^2, and by Cauchy-Schwarz also
+        // >= (sum a - sum b)^2 / dimension.
+        static double ComputeBounded(const Patch<float> &a,
+                                     const Patch<float> &b, double bound) {
+          double norms = static_cast<double>(a.norm()) - b.norm();
+          double sums = static_cast<double>(a.sum()) - b.sum();
+          double lower = std::max(norms * norms, sums * sums / a.size());
+          if (lower >= bound) return lower;
+          return RunBounded<SquaredDifferenceOp>(a, b, bound);
+        }
+
+        // Quantized patches, in quantized units (see Quantize). A
+        // whole byte patch is only a few vector loads, so the bounded
+        // version stops at the lower bounds.
+        static double Compute(const Patch<uint8_t> &a,
+                              const Patch<uint8_t> &b) {
+          return RunBytes<ByteSquaredDifferenceOp>(a, b);
+        }
+
+        static double ComputeBounded(const Patch<uint8_t> &a,
+                                     const Patch<uint8_t> &b,
+                                     double bound) {
+          double norms = static_cast<double>(a.norm()) - b.norm();
+          double sums = static_cast<double>(a.sum()) - b.sum();
+          double lower = std::max(norms * norms, sums * sums / a.size());
+          if (lower >= bound) return lower;
+          return Compute(a, b);
+        }
+      };
+
+      struct L1 {
+        template <typename VectorType>
+        static double Compute(const VectorType &a, const VectorType &b) {
+          double result = 0.0;
+          for (int i = 0; i < a.size(); ++i) {
+            result += fabs(a[i] - b[i]);
+          }
+          return result;
+        }
+
+        static double Compute(const Patch<float> &a, const Patch<float> &b) {
+          float sums[3];
+          Run<AbsoluteDifferenceOp>(a, b, sums);
+          return sums[0];
+        }
+
+        // |a - b|_1 >= |sum a - sum b|.
+        static double ComputeBounded(const Patch<float> &a,
+                                     const Patch<float> &b, double bound) {
+          double lower = fabs(static_cast<double>(a.sum()) - b.sum());
+          if (lower >= bound) return lower;
+          return RunBounded<AbsoluteDifferenceOp>(a, b, bound);
+        }
+
+        static double Compute(const Patch<uint8_t> &a,
+                              const Patch<uint8_t> &b) {
+          return RunBytes<ByteAbsoluteDifferenceOp>(a, b);
+        }
+
+        static double ComputeBounded(const Patch<uint8_t> &a,
+                                     const Patch<uint8_t> &b,
+                                     double bound) {
+          double lower = fabs(static_cast<double>(a.sum()) - b.sum());
+          if (lower >= bound) return lower;
+          return Compute(a, b);
+        }
+      };
+
+      // -a . b, which ranks like the cosine distance on the L2
+      // normalized HOG histograms but skips the norms.
+      struct NegativeDot {
+        template <typename VectorType>
+        static double Compute(const VectorType &a, const VectorType &b) {
+          double result = 0.0;
+          for (int i = 0; i < a.size(); ++i) {
+            result -= a[i] * b[i];
+          }
+          return result;
+        }
+
+        static double Compute(const Patch<float> &a, const Patch<float> &b) {
+          float sums[3];
+          Run<DotOp>(a, b, sums);
+          return -sums[0];
+        }
+      };
+
+      // 1 - cos(a, b)
+      struct Cosine {
+        template <typename VectorType>
+        static double Compute(const VectorType &a, const VectorType &b) {
+          double sums[3] = {0.0, 0.0, 0.0};
+          for (int i = 0; i < a.size(); ++i) {
+            sums[0] += a[i] * b[i];
+            sums[1] += a[i] * a[i];
+            sums[2] += b[i] * b[i];
+          }
+          return Finish(sums[0], sums[1], sums[2]);
+        }
+
+        static double Compute(const Patch<float> &a, const Patch<float> &b) {
+          float sums[3];
+          Run<DotOp>(a, b, sums);
+          return Finish(sums[0], sums[1], sums[2]);
+        }
+
+      private:
+        static inline double Finish(double dot, double aa, double bb) {
+          return 1.0 - dot / sqrt(aa * bb + epsilon * epsilon);
+        }
+      };
+
+      struct ChiSquared {
+        template <typename VectorType>
+        static double Compute(const VectorType &a, const VectorType &b) {
+          float sums[3] = {0.0f, 0.0f, 0.0f};
+          for (int i = 0; i < a.size(); ++i) {
+            ChiSquaredOp::Scalar(a[i], b[i], sums);
+          }
+          return sums[0];
+        }
+
+        static double Compute(const Patch<float> &a, const Patch<float> &b) {
+          float sums[3];
+          Run<ChiSquaredOp>(a, b, sums);
+          return sums[0];
+        }
+
+        // By Cauchy-Schwarz, chi^2 >= (sum a - sum b)^2 / (sum a + sum b)
+        // for non-negative histograms.
+        static double ComputeBounded(const Patch<float> &a,
+                                     const Patch<float> &b, double bound) {
+          double total = static_cast<double>(a.sum()) + b.sum();
+          if (total > 0.0) {
+            double difference = static_cast<double>(a.sum()) - b.sum();
+            double lower = difference * difference / total;
+            if (lower >= bound) return lower;
+          }
+          return RunBounded<ChiSquaredOp>(a, b, bound);
+        }
+      };
+
+    }  // namespace simd
+  }  // namespace algebra
+}  // namespace icon_fitter
+
+#endif  // _ICON_FITTER_SIMD_DISTANCE_
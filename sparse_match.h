@@ -0,0 +1,407 @@
+#ifndef _ICON_FITTER_SPARSE_MATCH_
+#define _ICON_FITTER_SPARSE_MATCH_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <random>
+#include <vector>
+
+#include "algebra.h"
+#include "feature_image.h"
+#include "patchmatch.h"
+
+namespace icon_fitter {
+
+  // How informative a template patch is.
+  enum PatchSaliency {
+    // Squared L2 norm of the patch, i.e. its total gradient energy.
+    SALIENCY_ENERGY,
+    // Orientation structure: for every cell, its gradient mass times
+    // how far its histogram is from uniform (log bins minus its
+    // entropy). Flat cells and cells of pure noise both score low.
+    SALIENCY_ENTROPY,
+  };
+
+  struct SparsePatchMatchOptions {
+    // initial_candidates, iterations, decay_rate, max_search_radius,
+    // termination_update_rate and verbose apply as in PatchMatch. The
+    // sparse solver always runs on one thread; match many templates
+    // at once (as BatchPatchMatch does) to use more cores.
+    PatchMatchOptions solver;
+
+    // Fraction of the template patches matched, the most salient
+    // ones, but never fewer than min_patches (or all of them).
+    double fraction = 0.25;
+    int min_patches = 16;
+    PatchSaliency saliency = SALIENCY_ENTROPY;
+
+    // Every selected patch propagates from up to this many nearest
+    // selected patches at most neighbor_radius blocks away, along
+    // both axes.
+    int neighbors = 4;
+    int neighbor_radius = 4;
+
+    // Transforms at most this many blocks apart, along both axes, vote
+    // for the same detection.
+    int vote_radius = 2;
+
+    SparsePatchMatchOptions() {
+      solver.initial_candidates = 20;
+      solver.verbose = false;
+    }
+  };
+
+  // The most salient patches of a template and the neighbor graph
+  // between them. Depends on the template only, so build it once and
+  // match it against every frame.
+  class SalientPatches {
+  public:
+    template <typename DataType>
+    SalientPatches(const BlockFeatureImage<DataType> &target,
+                   const SparsePatchMatchOptions &options) {
+      const int size = target.height * target.width;
+      std::vector<double> scores(size);
+      for (int id = 0; id < size; ++id) {
+        scores[id] = Score(target.GetPatch(id), options.saliency);
+      }
+
+      // Top patches, then back in raster order so that the scans walk
+      // the template the way the dense solver does.
+      int count = static_cast<int>(ceil(options.fraction * size));
+      count = std::min(std::max(count, options.min_patches), size);
+      std::vector<int> ids(size);
+      for (int id = 0; id < size; ++id) {
+        ids[id] = id;
+      }
+      std::nth_element(ids.begin(), ids.begin() + count, ids.end(),
+                       [&scores](int a, int b) {
+                         return scores[a] > scores[b] ||
+                           (scores[a] == scores[b] && a < b);
+                       });
+      ids.resize(count);
+      std::sort(ids.begin(), ids.end());
+      positions_.resize(count);
+      saliency_.resize(count);
+      std::vector<int> index(size, -1);
+      for (int k = 0; k < count; ++k) {
+        positions_[k].y = ids[k] / target.width;
+        positions_[k].x = ids[k] % target.width;
+        saliency_[k] = scores[ids[k]];
+        index[ids[k]] = k;
+      }
+
+      // Neighbor graph, in compressed rows.
+      const int radius = std::max(options.neighbor_radius, 0);
+      neighbor_begin_.assign(1, 0);
+      std::vector<std::pair<int, int> > nearby;
+      for (int k = 0; k < count; ++k) {
+        const Transform &p = positions_[k];
+        nearby.clear();
+        for (int y = std::max(p.y - radius, 0);
+             y <= std::min(p.y + radius, target.height - 1); ++y) {
+          for (int x = std::max(p.x - radius, 0);
+               x <= std::min(p.x + radius, target.width - 1); ++x) {
+            int other = index[y * target.width + x];
+            if (other < 0 || other == k) continue;
+            int dy = y - p.y;
+            int dx = x - p.x;
+            nearby.emplace_back(dy * dy + dx * dx, other);
+          }
+        }
+        int keep = std::min(static_cast<int>(nearby.size()),
+                            std::max(options.neighbors, 0));
+        std::partial_sort(nearby.begin(), nearby.begin() + keep,
+                          nearby.end());
+        for (int n = 0; n < keep; ++n) {
+          neighbors_.push_back(nearby[n].second);
+        }
+        neighbor_begin_.push_back(static_cast<int>(neighbors_.size()));
+      }
+    }
+
+    int size() const {
+      return static_cast<int>(positions_.size());
+    }
+
+    // Target block position of the k-th selected patch.
+    const Transform &position(int k) const {
+      return positions_[k];
+    }
+
+    double saliency(int k) const {
+      return saliency_[k];
+    }
+
+    // The selected patches the k-th one propagates from, as indices
+    // into this list.
+    const int *neighbors_begin(int k) const {
+      return neighbors_.data() + neighbor_begin_[k];
+    }
+
+    const int *neighbors_end(int k) const {
+      return neighbors_.data() + neighbor_begin_[k + 1];
+    }
+
+  private:
+    template <typename DataType>
+    static double Score(const Patch<DataType> &patch,
+                        PatchSaliency saliency) {
+      if (SALIENCY_ENERGY == saliency) {
+        return static_cast<double>(patch.norm()) * patch.norm();
+      }
+      const int runs = patch.runs();
+      const int bins = patch.run_length();
+      const double uniform = log(static_cast<double>(bins));
+      double score = 0.0;
+      for (int r = 0; r < runs; ++r) {
+        double mass = 0.0;
+        for (int b = 0; b < bins; ++b) {
+          mass += patch[r * bins + b];
+        }
+        if (mass <= algebra::epsilon) continue;
+        double entropy = 0.0;
+        for (int b = 0; b < bins; ++b) {
+          double p = patch[r * bins + b] / mass;
+          if (p > 0.0) entropy -= p * log(p);
+        }
+        score += mass * (uniform - entropy);
+      }
+      return score;
+    }
+
+    std::vector<Transform> positions_;
+    std::vector<double> saliency_;
+    std::vector<int> neighbor_begin_;
+    std::vector<int> neighbors_;
+  };
+
+  struct SparseMatch {
+    // Where the template as a whole lands in the source: the mean of
+    // the transforms that agree with the strongest vote.
+    Transform transform;
+    // Selected patches whose transform agrees with transform, out of
+    // all the selected ones.
+    int support = 0;
+    int votes = 0;
+    // Sum of the distances of the selected patches.
+    double energy = 0.0;
+    // Distances computed, the initial candidates included.
+    long long evaluations = 0;
+    // Per selected patch, in SalientPatches order.
+    std::vector<Transform> transforms;
+    std::vector<double> scores;
+  };
+
+  namespace {
+    struct TransformVote {
+      int y;
+      int x;
+      int count;
+      double score;
+    };
+
+    // Calls visit(vote) for every vote at most radius away from
+    // center along both axes. votes are distinct and sorted by (y, x),
+    // so each row of the window is one binary search and a short scan.
+    template <typename Visit>
+    inline void VisitVoteWindow(const std::vector<TransformVote> &votes,
+                                const TransformVote &center, int radius,
+                                Visit visit) {
+      for (int y = center.y - radius; y <= center.y + radius; ++y) {
+        TransformVote low {y, center.x - radius, 0, 0.0};
+        auto it = std::lower_bound(
+            votes.begin(), votes.end(), low,
+            [](const TransformVote &a, const TransformVote &b) {
+              return a.y < b.y || (a.y == b.y && a.x < b.x);
+            });
+        for (; it != votes.end() && it->y == y &&
+               it->x <= center.x + radius; ++it) {
+          visit(*it);
+        }
+      }
+    }
+
+    // The transform backed by the most votes within radius of it, along
+    // both axes, refined to the rounded mean of those votes. Ties go to
+    // the lower summed score. Returns the support, 0 when there are no
+    // votes.
+    inline int VoteTransform(const std::vector<Transform> &transforms,
+                             const std::vector<double> &scores,
+                             int radius, Transform *result) {
+      std::vector<int> order(transforms.size());
+      for (size_t k = 0; k < order.size(); ++k) {
+        order[k] = static_cast<int>(k);
+      }
+      std::sort(order.begin(), order.end(), [&transforms](int a, int b) {
+          return transforms[a].y < transforms[b].y ||
+            (transforms[a].y == transforms[b].y &&
+             transforms[a].x < transforms[b].x);
+        });
+      std::vector<TransformVote> votes;
+      votes.reserve(transforms.size());
+      for (int k : order) {
+        const Transform &t = transforms[k];
+        if (votes.empty() || votes.back().y != t.y || votes.back().x != t.x) {
+          votes.push_back(TransformVote {t.y, t.x, 0, 0.0});
+        }
+        ++votes.back().count;
+        votes.back().score += scores[k];
+      }
+
+      int best = -1;
+      int best_support = 0;
+      double best_score = 0.0;
+      for (size_t c = 0; c < votes.size(); ++c) {
+        int support = 0;
+        double score = 0.0;
+        VisitVoteWindow(votes, votes[c], radius,
+                        [&support, &score](const TransformVote &vote) {
+                          support += vote.count;
+                          score += vote.score;
+                        });
+        if (support > best_support ||
+            (support == best_support && score < best_score)) {
+          best = static_cast<int>(c);
+          best_support = support;
+          best_score = score;
+        }
+      }
+
+      *result = Transform();
+      if (best < 0) return 0;
+      double y = 0.0;
+      double x = 0.0;
+      VisitVoteWindow(votes, votes[best], radius,
+                      [&y, &x](const TransformVote &vote) {
+                        y += static_cast<double>(vote.y) * vote.count;
+                        x += static_cast<double>(vote.x) * vote.count;
+                      });
+      result->y = static_cast<int>(floor(y / best_support + 0.5));
+      result->x = static_cast<int>(floor(x / best_support + 0.5));
+      return best_support;
+    }
+  }  // namespace
+
+  // PatchMatch restricted to the salient template patches. Random
+  // initialization and random search run as in the dense solver, and
+  // propagation follows the neighbor graph instead of the block grid,
+  // alternating between forward and reverse order over the patches.
+  // The detection is voted from the resulting transforms rather than
+  // averaged, so the few patches that lock onto clutter do not drag it
+  // around.
+  //
+  // Work per round is proportional to patches.size(), i.e. roughly to
+  // options.fraction of the dense solver's. When source was built with
+  // regions, only its valid blocks are matched.
+  template <typename DataType, typename Distance = algebra::L2>
+  SparseMatch SparsePatchMatch(const BlockFeatureImage<DataType> &source,
+                               const BlockFeatureImage<DataType> &target,
+                               const SalientPatches &patches,
+                               const SparsePatchMatchOptions &options) {
+    if (source.dimension != target.dimension) {
+      printf("[ERROR] dimension mismatch between source and target.");
+      exit(-1);
+    }
+    if (0 == source.height * source.width) {
+      printf("[ERROR] the source is smaller than one block.");
+      exit(-1);
+    }
+    if (nullptr != source.regions() && 0 == source.regions()->area()) {
+      printf("[ERROR] no source region holds a whole block.");
+      exit(-1);
+    }
+    const PatchMatchOptions &solver = options.solver;
+    const int count = patches.size();
+    std::vector<std::mt19937> generators;
+    MakeGenerators(1, &generators);
+    std::mt19937 &generator = generators[0];
+
+    // Initialization
+    SparseMatch match;
+    std::vector<Transform> &transforms = match.transforms;
+    std::vector<double> &scores = match.scores;
+    transforms.resize(count);
+    scores.resize(count);
+    const RegionMask *regions = source.regions();
+    std::uniform_int_distribution<int> y_random(0, source.height - 1);
+    std::uniform_int_distribution<int> x_random(0, source.width - 1);
+    const int candidates = std::max(solver.initial_candidates, 1);
+    double energy = 0.0;
+    for (int k = 0; k < count; ++k) {
+      const Transform &p = patches.position(k);
+      const Patch<DataType> &patch = target.GetPatch(p.y, p.x);
+      scores[k] = std::numeric_limits<double>::max();
+      for (int c = 0; c < candidates; ++c) {
+        int y = 0;
+        int x = 0;
+        if (nullptr != regions) {
+          regions->Sample(generator, &y, &x);
+        } else {
+          y = y_random(generator);
+          x = x_random(generator);
+        }
+        TryCandidate<DataType, Distance>(source, patch, p.y, p.x, y, x,
+                                         &transforms[k], &scores[k]);
+      }
+      energy += scores[k];
+    }
+    if (solver.verbose) {
+      printf("Initial Energy: %.6lf\n", energy);
+    }
+
+    // Iterations
+    BoundaryChecker in_boundary {source.height, source.width, regions};
+    double max_radius = std::max(source.height, source.width);
+    if (0 < solver.max_search_radius &&
+        solver.max_search_radius < max_radius) {
+      max_radius = solver.max_search_radius;
+    }
+    long long evaluations = static_cast<long long>(count) * candidates;
+    for (int round = 0; round < solver.iterations; ++round) {
+      int updates = 0;
+      bool forward = 0 == round % 2;
+      for (int step = 0; step < count; ++step) {
+        int k = forward ? step : count - 1 - step;
+        const Transform &p = patches.position(k);
+        const Patch<DataType> &patch = target.GetPatch(p.y, p.x);
+        double previous = scores[k];
+        bool updated = false;
+        for (const int *n = patches.neighbors_begin(k);
+             n != patches.neighbors_end(k); ++n) {
+          updated |= Propagate<DataType, Distance>(
+              source, patch, p.y, p.x, transforms[*n], in_boundary,
+              &transforms[k], &scores[k], &evaluations);
+        }
+        updated |= RandomSearch<DataType, Distance>(
+            source, patch, p.y, p.x, max_radius, solver.decay_rate,
+            in_boundary, generator, &transforms[k], &scores[k],
+            &evaluations);
+        if (updated) {
+          ++updates;
+          energy += scores[k] - previous;
+        }
+      }
+      if (solver.verbose) {
+        printf("Round %d Energy: %.6lf\n", round, energy);
+      }
+      if (updates < static_cast<int>(count * solver.termination_update_rate)) {
+        if (solver.verbose) printf("Early termination.\n");
+        break;
+      }
+    }
+
+    match.energy = energy;
+    match.evaluations = evaluations;
+    match.votes = count;
+    match.support = VoteTransform(transforms, scores,
+                                  std::max(options.vote_radius, 0),
+                                  &match.transform);
+    return match;
+  }
+
+}  // namespace icon_fitter
+
+#endif  // _ICON_FITTER_SPARSE_MATCH_
@@ -0,0 +1,65 @@
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+
+#include "opencv2/imgproc.hpp"
+#include "opencv2/videoio.hpp"
+
+#include "feature_image.h"
+#include "hog.h"
+#include "simd_distance.h"
+#include "stream_match.h"
+
+using namespace icon_fitter;
+
+// Usage: stream_match <template> <video file or image pattern> [threads]
+//
+// The input is anything cv::VideoCapture opens, including printf-style
+// image sequences such as frames/%04d.png.
+int main(int argc, char **argv) {
+  if (argc < 3) {
+    printf("Usage: %s <template> <video> [threads]\n", argv[0]);
+    return -1;
+  }
+
+  StreamOptions options;
+  if (argc > 3) {
+    options.cold.threads = atoi(argv[3]);
+    options.warm.threads = atoi(argv[3]);
+  }
+
+  // template
+  FeatureImage<float> template_image = HogGen::Create(argv[1], options.hog);
+  BlockFeatureImage<float> target(&template_image, options.block_size,
+                                  options.stride, BLOCK_MATERIALIZED);
+
+  cv::VideoCapture capture(argv[2]);
+  if (!capture.isOpened()) {
+    printf("Error: Failed to open stream %s\n", argv[2]);
+    return -1;
+  }
+
+  StreamMatcher<algebra::simd::L2> matcher(&target, options);
+  cv::Mat frame;
+  int frames = 0;
+  int warm_frames = 0;
+  double total_ms = 0.0;
+  while (capture.read(frame)) {
+    auto start = std::chrono::steady_clock::now();
+    const TemplateMatch &match = matcher.Process(frame);
+    double ms = std::chrono::duration<double, std::milli>(
+        std::chrono::steady_clock::now() - start).count();
+    printf("frame %d: (%d, %d) energy %.6lf %s %.2f ms\n", frames,
+           match.mean.y, match.mean.x, match.energy,
+           matcher.warm() ? "warm" : "cold", ms);
+    total_ms += ms;
+    warm_frames += matcher.warm() ? 1 : 0;
+    ++frames;
+  }
+
+  if (frames > 0) {
+    printf("%d frames (%d warm), %.2f ms/frame, %.1f fps\n", frames,
+           warm_frames, total_ms / frames, 1000.0 * frames / total_ms);
+  }
+  return 0;
+}
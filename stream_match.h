@@ -0,0 +1,152 @@
+#ifndef _ICON_FITTER_STREAM_MATCH_
+#define _ICON_FITTER_STREAM_MATCH_
+
+#include <memory>
+#include <vector>
+
+#include "opencv2/imgproc.hpp"
+
+#include "algebra.h"
+#include "batch_match.h"
+#include "feature_image.h"
+#include "hog.h"
+#include "patchmatch.h"
+
+namespace icon_fitter {
+
+  struct StreamOptions {
+    // Frame features, which must be built the same way as the
+    // template's BlockFeatureImage.
+    HogOptions hog {6, 9, false};
+    int block_size = 3;
+    int stride = 6;
+
+    // Where the logo may appear in the frame (see Region). Features
+    // are only computed, and matches only searched, inside. Empty
+    // covers the whole frame.
+    std::vector<Region> regions;
+
+    // Solver for the first frame and after a reset.
+    PatchMatchOptions cold;
+    // Solver for frames seeded from the previous frame's map.
+    PatchMatchOptions warm;
+
+    // A warm frame whose energy exceeds this multiple of the last cold
+    // frame's energy (scene cut, logo gone) is solved cold again.
+    double reset_ratio = 2.0;
+
+    StreamOptions() {
+      cold.iterations = 10;
+      cold.initial_candidates = 20;
+      cold.verbose = false;
+      warm.iterations = 2;
+      warm.initial_candidates = 1;
+      warm.max_search_radius = 8.0;
+      warm.termination_stable_rounds = 1;
+      warm.verbose = false;
+    }
+  };
+
+  // Matches one template against consecutive frames of a stream. Each
+  // frame starts from the previous frame's TransformMap, so only a
+  // couple of short-radius refinement rounds are needed while the logo
+  // stays put. Frame features, blocks and solver buffers are kept
+  // between frames, so a stream of constant resolution does not
+  // allocate once it is running.
+  template <typename Distance = algebra::L2>
+  class StreamMatcher {
+  public:
+    StreamMatcher(const BlockFeatureImage<float> *target,
+                  const StreamOptions &options)
+      : target_(target), options_(options), has_previous_(false),
+        warm_(false), reference_energy_(0.0), source_height_(0),
+        source_width_(0), features_(0, 0, options.hog.bins) {}
+
+    const TemplateMatch &Process(const cv::Mat &frame) {
+      HogGen::Create(frame, options_.hog, options_.regions, &hog_workspace_,
+                     &features_);
+      if (nullptr == source_) {
+        source_.reset(new BlockFeatureImage<float>(
+            &features_, options_.block_size, options_.stride, BLOCK_LAZY,
+            &options_.regions));
+      } else {
+        source_->Reset(&features_, options_.block_size, options_.stride,
+                       BLOCK_LAZY, &options_.regions);
+      }
+      return Process(*source_);
+    }
+
+    // A source without any block inside its regions (a frame smaller
+    // than the regions) gives an empty match, like an empty source.
+    const TemplateMatch &Process(const BlockFeatureImage<float> &source) {
+      int size = target_->height * target_->width;
+      if (0 == size || 0 == source.height * source.width ||
+          (nullptr != source.regions() && 0 == source.regions()->area())) {
+        Reset();
+        last_ = TemplateMatch();
+        return last_;
+      }
+
+      warm_ = has_previous_ && source.height == source_height_ &&
+        source.width == source_width_;
+      if (warm_) {
+        double energy = 0.0;
+        const TransformMap &seeded = PatchMatchInto<float, Distance>(
+            source, *target_, options_.warm, &last_.transforms, &workspace_,
+            &energy);
+        energy /= size;
+        if (energy <= reference_energy_ * options_.reset_ratio +
+            algebra::epsilon) {
+          Finish(seeded, energy);
+          return last_;
+        }
+        warm_ = false;
+      }
+
+      double energy = 0.0;
+      const TransformMap &fresh = PatchMatchInto<float, Distance>(
+          source, *target_, options_.cold, nullptr, &workspace_, &energy);
+      energy /= size;
+      reference_energy_ = energy;
+      source_height_ = source.height;
+      source_width_ = source.width;
+      has_previous_ = true;
+      Finish(fresh, energy);
+      return last_;
+    }
+
+    // Forgets the previous frame; the next one is solved cold.
+    void Reset() {
+      has_previous_ = false;
+    }
+
+    // Whether the last processed frame was warm started.
+    bool warm() const {
+      return warm_;
+    }
+
+  private:
+    void Finish(const TransformMap &transforms, double energy) {
+      last_.transforms.CopyFrom(transforms);
+      last_.mean = MeanTransform(last_.transforms);
+      last_.energy = energy;
+    }
+
+    const BlockFeatureImage<float> *target_;
+    StreamOptions options_;
+    TemplateMatch last_;
+    bool has_previous_;
+    bool warm_;
+    double reference_energy_;
+    int source_height_;
+    int source_width_;
+    // Per-frame buffers, reused from frame to frame.
+    HogWorkspace hog_workspace_;
+    FeatureImage<float> features_;
+    std::unique_ptr<BlockFeatureImage<float> > source_;
+    PatchMatchWorkspace workspace_;
+  };
+
+}  // namespace icon_fitter
+
+#endif  // _ICON_FITTER_STREAM_MATCH_
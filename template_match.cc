@@ -1,50 +1,15 @@
 #include <cstdio>
 #include <string>
+#include <vector>
 
 #include "opencv2/highgui.hpp"
 #include "opencv2/imgproc.hpp"
 
-class TemplatePyramid {
-public:
-  static const int MIN_DIMENSION;
-  TemplatePyramid(const cv::Mat &input, double shrink_rate) 
-    : templates_() {
-    cv::Mat current = input;
-    while (MIN_DIMENSION <= current.rows &&
-           MIN_DIMENSION <= current.cols) {
-      cv::GaussianBlur(current, current, cv::Size(5, 5), 1.2, 1.2);
-      templates_.push_back(GetGradient(current));
-      cv::resize(current, current, 
-                 cv::Size(current.cols * shrink_rate,
-                          current.rows * shrink_rate));
-    }
-  }
+#include "feature_cache.h"
+#include "template_pyramid.h"
+#include "template_search.h"
 
-  TemplatePyramid(const std::string &path, double shrink_rate) 
-    : TemplatePyramid(cv::imread(path), shrink_rate) {}
-  
-  int layers() const {
-    return templates_.size();
-  }
-  
-  const cv::Mat &layer(int id) const {
-    return templates_[id];
-  }
-
-private:
-  
-  cv::Mat GetGradient(const cv::Mat &input) {
-    cv::Mat result;
-    cv::cvtColor(input, result, cv::COLOR_BGR2GRAY);
-    cv::Mat edges(input.rows, input.cols, CV_32FC1);
-    cv::Canny(result, edges, 100.0, 300.0, 5);
-    return edges;
-  }
-  
-  std::vector<cv::Mat> templates_;
-};
-
-const int TemplatePyramid::MIN_DIMENSION = 20;
+using namespace icon_fitter;
 
 TemplatePyramid LoadTemplate(const char *path) {
   cv::Mat raw = cv::imread(path);
@@ -92,9 +57,57 @@ void GenerateMatch(const TemplatePyramid &templates,
   }
 }
 
+// Usage: template_match <template> <target> [pyramid cache] [--dump]
+//
+// Prints the best match over all template pyramid layers. --dump also
+// writes the per-layer matches to output/ as before.
 int main(int argc, char **argv) {
-  GenerateMatch(TemplatePyramid(argv[1], 0.8),
-                LoadTarget(argv[2]));
+  std::vector<const char*> paths;
+  bool dump = false;
+  for (int i = 1; i < argc; ++i) {
+    if (std::string("--dump") == argv[i]) {
+      dump = true;
+    } else {
+      paths.push_back(argv[i]);
+    }
+  }
+  if (paths.size() < 2) {
+    printf("Usage: %s <template> <target> [pyramid cache] [--dump]\n",
+           argv[0]);
+    return -1;
+  }
+  const char *template_path = paths[0];
+  const char *target_path = paths[1];
+  const char *cache_path = paths.size() > 2 ? paths[2] : nullptr;
+
+  const double shrink_rate = 0.8;
+  TemplatePyramid templates((std::vector<cv::Mat>()));
+  bool cached = nullptr != cache_path &&
+    FeatureCache::IsFresh(cache_path, template_path) &&
+    FeatureCache::LoadPyramid(cache_path, shrink_rate, &templates);
+  if (!cached) {
+    templates = TemplatePyramid(template_path, shrink_rate);
+    if (nullptr != cache_path &&
+        !FeatureCache::SavePyramid(cache_path, templates, shrink_rate)) {
+      printf("Warning: failed to write pyramid cache %s\n", cache_path);
+    }
+  }
+
+  cv::Mat target = LoadTarget(target_path);
+  TemplateSearchResult match = SearchPyramid(templates, target,
+                                             TemplateSearchOptions());
+  if (match.layer < 0) {
+    printf("No template layer fits in the target.\n");
+  } else {
+    printf("layer %d at (%d, %d) size %dx%d score %.6lf "
+           "(%d layers searched, %d pruned)\n",
+           match.layer, match.location.x, match.location.y,
+           match.box.width, match.box.height, match.score,
+           match.searched, match.pruned);
+  }
+
+  if (dump) {
+    GenerateMatch(templates, target);
+  }
   return 0;
 }
-
@@ -0,0 +1,64 @@
+#ifndef _ICON_FITTER_TEMPLATE_PYRAMID_
+#define _ICON_FITTER_TEMPLATE_PYRAMID_
+
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "opencv2/highgui.hpp"
+#include "opencv2/imgproc.hpp"
+
+namespace icon_fitter {
+
+  class TemplatePyramid {
+  public:
+    static constexpr int MIN_DIMENSION = 20;
+
+    TemplatePyramid(const cv::Mat &input, double shrink_rate) 
+      : templates_() {
+      cv::Mat current = input;
+      while (MIN_DIMENSION <= current.rows &&
+             MIN_DIMENSION <= current.cols) {
+        cv::GaussianBlur(current, current, cv::Size(5, 5), 1.2, 1.2);
+        templates_.push_back(GetGradient(current));
+        cv::resize(current, current, 
+                   cv::Size(current.cols * shrink_rate,
+                            current.rows * shrink_rate));
+      }
+    }
+
+    TemplatePyramid(const std::string &path, double shrink_rate) 
+      : TemplatePyramid(cv::imread(path), shrink_rate) {}
+
+    // Adopts precomputed layers, e.g. from a cache file. owner keeps
+    // whatever backs the layers' pixels alive.
+    TemplatePyramid(std::vector<cv::Mat> layers,
+                    std::shared_ptr<void> owner = nullptr)
+      : templates_(std::move(layers)), owner_(std::move(owner)) {}
+  
+    int layers() const {
+      return templates_.size();
+    }
+  
+    const cv::Mat &layer(int id) const {
+      return templates_[id];
+    }
+
+  private:
+  
+    cv::Mat GetGradient(const cv::Mat &input) {
+      cv::Mat result;
+      cv::cvtColor(input, result, cv::COLOR_BGR2GRAY);
+      cv::Mat edges(input.rows, input.cols, CV_32FC1);
+      cv::Canny(result, edges, 100.0, 300.0, 5);
+      return edges;
+    }
+  
+    std::vector<cv::Mat> templates_;
+    std::shared_ptr<void> owner_;
+  };
+
+}  // namespace icon_fitter
+
+#endif  // _ICON_FITTER_TEMPLATE_PYRAMID_
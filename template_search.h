@@ -0,0 +1,234 @@
+#ifndef _ICON_FITTER_TEMPLATE_SEARCH_
+#define _ICON_FITTER_TEMPLATE_SEARCH_
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
+#include "opencv2/imgproc.hpp"
+
+#include "template_pyramid.h"
+
+namespace icon_fitter {
+
+  struct TemplateSearchOptions {
+    // Layers searched concurrently; 0 uses every core OpenMP reports.
+    int threads = 0;
+
+    // Layers taller or wider than this fraction of the target are
+    // skipped.
+    double max_relative_size = 0.5;
+
+    // Cascade. The target is halved repeatedly down to coarse_scale,
+    // and every layer is first matched against the smallest level on
+    // which it still measures min_coarse_size pixels both ways. The
+    // best `candidates` coarse locations are then refined at full
+    // resolution inside ROIs that add refine_margin coarse pixels
+    // around the layer. Layers too small for any level are matched
+    // against the whole full resolution target.
+    double coarse_scale = 0.25;
+    int min_coarse_size = 12;
+    int candidates = 3;
+    int refine_margin = 2;
+
+    // A layer whose coarse score exceeds the best coarse score of all
+    // layers by more than prune_margin is not refined at all. This is a
+    // heuristic: coarse TM_SQDIFF_NORMED scores are comparable between
+    // layers, but a layer that loses at the coarse level by more than
+    // the margin is assumed to lose at full resolution too. Pruning
+    // only depends on the coarse pass, so the layers searched and the
+    // result are the same for any number of threads. Layers matched
+    // at full resolution only are never pruned.
+    double prune_margin = 0.1;
+  };
+
+  struct TemplateSearchResult {
+    // Pyramid layer of the best match, -1 when no layer was searched.
+    int layer = -1;
+    // Top left corner of the match in the target.
+    cv::Point location;
+    // cv::TM_SQDIFF_NORMED score, in [0, 1], lower is better. The
+    // normalization keeps scores of different layers comparable.
+    double score = std::numeric_limits<double>::infinity();
+    cv::Rect box;
+    // Layers searched at full resolution and layers pruned.
+    int searched = 0;
+    int pruned = 0;
+  };
+
+  namespace {
+    // Best (lowest) TM_SQDIFF_NORMED score of layer in image.
+    inline double BestMatch(const cv::Mat &image, const cv::Mat &layer,
+                            cv::Point *location) {
+      cv::Mat scores;
+      cv::matchTemplate(image, layer, scores, cv::TM_SQDIFF_NORMED);
+      double min_value, max_value;
+      cv::Point min_loc, max_loc;
+      cv::minMaxLoc(scores, &min_value, &max_value, &min_loc, &max_loc);
+      if (nullptr != location) *location = min_loc;
+      return min_value;
+    }
+
+    // Up to count local minima of scores, lowest first. Each one masks
+    // the window of size suppress centred on it before the next is
+    // taken.
+    inline std::vector<cv::Point> LowestPeaks(const cv::Mat &scores,
+                                              int count,
+                                              const cv::Size &suppress,
+                                              double *best) {
+      std::vector<cv::Point> peaks;
+      cv::Mat remaining = scores.clone();
+      for (int k = 0; k < count; ++k) {
+        double min_value, max_value;
+        cv::Point min_loc, max_loc;
+        cv::minMaxLoc(remaining, &min_value, &max_value, &min_loc, &max_loc);
+        if (min_value == std::numeric_limits<float>::max()) break;
+        if (0 == k && nullptr != best) *best = min_value;
+        peaks.push_back(min_loc);
+        cv::Rect masked(min_loc.x - suppress.width / 2,
+                        min_loc.y - suppress.height / 2,
+                        suppress.width, suppress.height);
+        masked &= cv::Rect(0, 0, remaining.cols, remaining.rows);
+        remaining(masked).setTo(std::numeric_limits<float>::max());
+      }
+      return peaks;
+    }
+  }  // namespace
+
+  // Multi-scale template search over every eligible pyramid layer.
+  // Replaces the sequential full-resolution sweep of GenerateMatch.
+  // Thanks to the coarse-to-fine cascade, full resolution matching only
+  // covers a few template-sized ROIs per layer.
+  inline TemplateSearchResult SearchPyramid(
+      const TemplatePyramid &templates, const cv::Mat &target,
+      const TemplateSearchOptions &options) {
+    TemplateSearchResult result;
+
+    std::vector<int> eligible;
+    for (int i = 0; i < templates.layers(); ++i) {
+      const cv::Mat &layer = templates.layer(i);
+      if (layer.rows <= target.rows * options.max_relative_size &&
+          layer.cols <= target.cols * options.max_relative_size) {
+        eligible.push_back(i);
+      }
+    }
+    int count = static_cast<int>(eligible.size());
+    if (0 == count) return result;
+
+#ifdef _OPENMP
+    int threads = options.threads > 0 ? options.threads : omp_get_max_threads();
+#else
+    int threads = 1;
+#endif
+
+    // Target pyramid, level k at scale 2^-k.
+    std::vector<cv::Mat> pyramid(1, target);
+    for (double scale = 0.5; scale >= options.coarse_scale; scale *= 0.5) {
+      cv::Mat smaller;
+      cv::resize(pyramid.back(), smaller, cv::Size(), 0.5, 0.5,
+                 cv::INTER_AREA);
+      pyramid.push_back(smaller);
+    }
+
+    // Coarse pass. Layers too small to shrink stay on level 0 with a
+    // coarse score of -infinity, so they are never pruned.
+    struct CoarseCandidates {
+      double score = -std::numeric_limits<double>::infinity();
+      // Target pyramid level (0 is the full resolution) and the
+      // candidate top left corners on it.
+      int level = 0;
+      std::vector<cv::Point> locations;
+    };
+    std::vector<CoarseCandidates> coarse(templates.layers());
+#pragma omp parallel for schedule(dynamic, 1) num_threads(threads) if (threads > 1)
+    for (int k = 0; k < count; ++k) {
+      const cv::Mat &layer = templates.layer(eligible[k]);
+      CoarseCandidates &candidates = coarse[eligible[k]];
+      int level = 0;
+      while (level + 1 < static_cast<int>(pyramid.size()) &&
+             std::min(layer.rows, layer.cols) >> (level + 1) >=
+             options.min_coarse_size) {
+        ++level;
+      }
+      if (0 == level) continue;
+      cv::Mat coarse_layer;
+      cv::resize(layer, coarse_layer,
+                 cv::Size(layer.cols >> level, layer.rows >> level), 0, 0,
+                 cv::INTER_AREA);
+      cv::Mat scores;
+      cv::matchTemplate(pyramid[level], coarse_layer, scores,
+                        cv::TM_SQDIFF_NORMED);
+      candidates.level = level;
+      candidates.locations = LowestPeaks(scores, options.candidates,
+                                         coarse_layer.size(),
+                                         &candidates.score);
+    }
+
+    // Pruning, against the best coarse score.
+    double bound = std::numeric_limits<double>::infinity();
+    for (int id : eligible) {
+      if (0 < coarse[id].level) bound = std::min(bound, coarse[id].score);
+    }
+    std::vector<int> refined;
+    for (int id : eligible) {
+      if (coarse[id].score <= bound + options.prune_margin) {
+        refined.push_back(id);
+      }
+    }
+    const int searched = static_cast<int>(refined.size());
+
+    // Full resolution pass.
+#pragma omp parallel for schedule(dynamic, 1) num_threads(threads) if (threads > 1)
+    for (int k = 0; k < searched; ++k) {
+      int id = refined[k];
+      const CoarseCandidates &candidates = coarse[id];
+      const cv::Mat &layer = templates.layer(id);
+      cv::Point location;
+      double score = std::numeric_limits<double>::infinity();
+      if (0 == candidates.level) {
+        score = BestMatch(target, layer, &location);
+      } else {
+        int margin = options.refine_margin << candidates.level;
+        cv::Rect frame(0, 0, target.cols, target.rows);
+        for (const cv::Point &candidate : candidates.locations) {
+          cv::Rect roi((candidate.x << candidates.level) - margin,
+                       (candidate.y << candidates.level) - margin,
+                       layer.cols + 2 * margin, layer.rows + 2 * margin);
+          roi &= frame;
+          if (roi.width < layer.cols || roi.height < layer.rows) continue;
+          cv::Point offset;
+          double refined = BestMatch(target(roi), layer, &offset);
+          if (refined < score) {
+            score = refined;
+            location = cv::Point(roi.x + offset.x, roi.y + offset.y);
+          }
+        }
+      }
+#pragma omp critical (icon_fitter_template_search)
+      {
+        if (score < result.score ||
+            (score == result.score && id < result.layer)) {
+          result.layer = id;
+          result.location = location;
+          result.score = score;
+        }
+      }
+    }
+
+    result.searched = searched;
+    result.pruned = count - searched;
+    if (result.layer >= 0) {
+      const cv::Mat &layer = templates.layer(result.layer);
+      result.box = cv::Rect(result.location.x, result.location.y,
+                            layer.cols, layer.rows);
+    }
+    return result;
+  }
+
+}  // namespace icon_fitter
+
+#endif  // _ICON_FITTER_TEMPLATE_SEARCH_
@@ -1,14 +1,35 @@
+#include <string>
+
 #include "opencv2/imgproc.hpp"
 #include "opencv2/highgui.hpp"
 
 #include "algebra.h"
 #include "feature_image.h"
 #include "hog.h"
+#include "hog_correlation.h"
+#include "patch_index.h"
 #include "patchmatch.h"
+#include "simd_distance.h"
+#include "sparse_match.h"
 #include "visualization.h"
 
 using namespace icon_fitter;
 
+namespace {
+  // Draws the template (argv[1]) placed at transform on the input
+  // (argv[2]) and waits for a key.
+  void ShowDetection(char **argv, const Transform &transform) {
+    cv::Mat input = cv::imread(argv[2]);
+    cv::Mat icon = cv::imread(argv[1]);
+    rectangle(input,
+              {transform.x, transform.y},
+              {transform.x + icon.cols, transform.y + icon.rows},
+              {0, 0, 255});
+    cv::imshow("input", input);
+    cv::waitKey(0);
+  }
+}  // namespace
+
 int main(int argc, char **argv) {
   if (argc < 3) {
     printf("Error: need more arguments.\n");
@@ -16,28 +37,59 @@ int main(int argc, char **argv) {
   
   // template
   FeatureImage<float> template_image = HogGen::Create(argv[1], {6, 9, false});
-  BlockFeatureImage<float> target(&template_image, 3, 6);
+  BlockFeatureImage<float> target(&template_image, 3, 6, BLOCK_MATERIALIZED);
 
   // input
   FeatureImage<float> input_image = HogGen::Create(argv[2], {6, 9, false});
   BlockFeatureImage<float> source(&input_image, 3, 6);
 
+  // Rigid detection by HOG cross-correlation, when asked for with a
+  // third argument "correlate".
+  if (argc > 3 && std::string("correlate") == argv[3]) {
+    HogCorrelator correlator(template_image);
+    CorrelationResult detection = correlator.Detect(input_image, 1);
+    if (!detection.peaks.empty()) {
+      cv::Mat input = cv::imread(argv[2]);
+      rectangle(input, detection.peaks[0].box, {0, 0, 255});
+      cv::imshow("input", input);
+      cv::waitKey(0);
+    }
+    return 0;
+  }
+
+  // PatchMatch on the most salient template patches only, detected by
+  // voting, when asked for with a third argument "sparse".
+  if (argc > 3 && std::string("sparse") == argv[3]) {
+    SparsePatchMatchOptions sparse;
+    SalientPatches patches(target, sparse);
+    SparseMatch match = SparsePatchMatch<float, algebra::simd::L2>(
+        source, target, patches, sparse);
+    printf("%d of %d patches agree\n", match.support, match.votes);
+    ShowDetection(argv, match.transform);
+    return 0;
+  }
+
+  // Nearest neighbor voting through a patch index, when asked for with
+  // a third argument "index".
+  if (argc > 3 && std::string("index") == argv[3]) {
+    PatchIndex<algebra::simd::L2> index({&target}, PatchIndexOptions());
+    IndexMatch match = index.Match(source)[0];
+    printf("%d of %d votes agree, energy %.6lf\n", match.support,
+           match.votes, match.energy);
+    ShowDetection(argv, match.transform);
+    return 0;
+  }
+
   // PatchMatch
   PatchMatchOptions options;
   options.iterations = 10;
   options.decay_rate = 0.5;
   options.initial_candidates = 20;
-  TransformMap result = PatchMatch(source, target, options);
+  TransformMap result = PatchMatch<float, algebra::simd::L2>(source, target,
+                                                          options);
 
   // Mean of Transform Map
-  Transform mean;
-  for (const Transform &transform : result.data()) {
-    mean.y += transform.y;
-    mean.x += transform.x;
-  }
-
-  mean.y /= target.height * target.width;
-  mean.x /= target.height * target.width;
+  Transform mean = MeanTransform(result);
 
   // Visualization match result
   {
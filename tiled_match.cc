@@ -0,0 +1,130 @@
+#include <sys/resource.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "opencv2/imgcodecs.hpp"
+
+#include "feature_image.h"
+#include "hog.h"
+#include "json.h"
+#include "simd_distance.h"
+#include "tiled_match.h"
+
+using namespace icon_fitter;
+
+namespace {
+  void Usage(const char *program) {
+    printf("Usage: %s --template <image> [--template <image>]... "
+           "[--tile height,width] [--raw rows,cols,channels] <input>...\n",
+           program);
+  }
+
+  void PrintMatch(const char *kind, const std::string &source, int frame,
+                  const TileMatch &match) {
+    printf("{\"%s\":{\"source\":%s,\"frame\":%d,\"template\":%d,"
+           "\"tile\":[%d,%d,%d,%d],\"y\":%d,\"x\":%d,\"support\":%d,"
+           "\"energy\":%.6f}}\n", kind, JsonQuote(source).c_str(), frame,
+           match.template_id, match.tile.y, match.tile.x, match.tile.height,
+           match.tile.width, match.transform.y, match.transform.x,
+           match.support, match.energy);
+    fflush(stdout);
+  }
+}  // namespace
+
+// Matches every template against large frames tile by tile, with peak
+// memory bounded by the tile size rather than the frame size (see
+// TiledMatcher). Every placement found in a tile is written as a
+// {"tile": ...} JSON line as soon as the tile is done, and the best
+// one of each template over the frame as a {"best": ...} line after
+// it. Inputs are images, or with --raw, files of headerless 8-bit
+// frames (e.g. ffmpeg -f rawvideo -pix_fmt bgr24) that are memory
+// mapped instead of decoded. The process peak RSS goes to stderr.
+int main(int argc, char **argv) {
+  TiledMatchOptions options;
+  std::vector<std::string> template_paths;
+  std::vector<std::string> inputs;
+  int raw_rows = 0;
+  int raw_cols = 0;
+  int raw_channels = 0;
+  for (int i = 1; i < argc; ++i) {
+    if (0 == strcmp(argv[i], "--template") && i + 1 < argc) {
+      template_paths.push_back(argv[++i]);
+    } else if (0 == strcmp(argv[i], "--tile") && i + 1 < argc) {
+      if (2 != sscanf(argv[++i], "%d,%d", &options.tile_height,
+                      &options.tile_width)) {
+        Usage(argv[0]);
+        return -1;
+      }
+    } else if (0 == strcmp(argv[i], "--raw") && i + 1 < argc) {
+      if (3 != sscanf(argv[++i], "%d,%d,%d", &raw_rows, &raw_cols,
+                      &raw_channels)) {
+        Usage(argv[0]);
+        return -1;
+      }
+    } else if ('-' == argv[i][0]) {
+      Usage(argv[0]);
+      return -1;
+    } else {
+      inputs.push_back(argv[i]);
+    }
+  }
+  if (template_paths.empty() || inputs.empty()) {
+    Usage(argv[0]);
+    return -1;
+  }
+
+  // Templates, built with the same HOG as the tiles.
+  std::vector<std::unique_ptr<FeatureImage<float> > > template_features;
+  std::vector<std::unique_ptr<BlockFeatureImage<float> > > template_blocks;
+  std::vector<const BlockFeatureImage<float>*> templates;
+  for (const std::string &path : template_paths) {
+    template_features.emplace_back(new FeatureImage<float>(
+        HogGen::Create(path, options.hog)));
+    template_blocks.emplace_back(new BlockFeatureImage<float>(
+        template_features.back().get(), options.block_size, options.stride,
+        BLOCK_MATERIALIZED));
+    templates.push_back(template_blocks.back().get());
+  }
+
+  TiledMatcher<algebra::simd::L2> matcher(templates, options);
+  for (const std::string &path : inputs) {
+    int frame = 0;
+    TileObserver observer = [&path, &frame](const TileMatch &match) {
+      PrintMatch("tile", path, frame, match);
+    };
+    auto report = [&](const std::vector<TileMatch> &best) {
+      for (const TileMatch &match : best) {
+        if (match.found) PrintMatch("best", path, frame, match);
+      }
+    };
+    if (raw_rows > 0) {
+      std::shared_ptr<RawFrameFile> file =
+        RawFrameFile::Open(path, raw_rows, raw_cols, raw_channels);
+      if (!file) {
+        fprintf(stderr, "Error: Failed to map raw frames %s\n",
+                path.c_str());
+        return -1;
+      }
+      for (frame = 0; frame < file->frames(); ++frame) {
+        report(matcher.Match(*file, frame, observer));
+      }
+    } else {
+      cv::Mat image = cv::imread(path);
+      if (image.empty()) {
+        fprintf(stderr, "Error: Failed to read image %s\n", path.c_str());
+        return -1;
+      }
+      report(matcher.Match(image, observer));
+    }
+  }
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  fprintf(stderr, "peak RSS %.1f MB\n", usage.ru_maxrss / 1024.0);
+  return 0;
+}
@@ -0,0 +1,300 @@
+#ifndef _ICON_FITTER_TILED_MATCH_
+#define _ICON_FITTER_TILED_MATCH_
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "opencv2/core.hpp"
+
+#include "algebra.h"
+#include "feature_image.h"
+#include "hog.h"
+#include "mapped_file.h"
+#include "patchmatch.h"
+#include "sparse_match.h"
+
+namespace icon_fitter {
+
+  // ---------- Raw Frames ----------
+  // Uncompressed 8-bit frames stored back to back, with no header and
+  // no row padding, the way ffmpeg -f rawvideo writes gray or bgr24
+  // pixels. Frames are cv::Mat headers over a private mapping of the
+  // file, so nothing is decoded or copied up front and pages are only
+  // read in as rows are touched.
+  class RawFrameFile {
+  public:
+    // Returns nullptr when the file cannot be mapped or does not hold
+    // a whole number of rows x cols x channels frames.
+    static std::shared_ptr<RawFrameFile> Open(const std::string &path,
+                                              int rows, int cols,
+                                              int channels) {
+      if (rows < 1 || cols < 1 ||
+          (1 != channels && 3 != channels && 4 != channels)) {
+        return nullptr;
+      }
+      std::shared_ptr<MappedFile> file = MappedFile::Open(path);
+      if (!file) return nullptr;
+      size_t frame_bytes = static_cast<size_t>(rows) * cols * channels;
+      if (0 != file->size() % frame_bytes) return nullptr;
+      return std::shared_ptr<RawFrameFile>(
+          new RawFrameFile(std::move(file), rows, cols, channels));
+    }
+
+    int frames() const {
+      return static_cast<int>(file_->size() / frame_bytes_);
+    }
+
+    // Frame k, valid for as long as this file is.
+    cv::Mat frame(int k) const {
+      return cv::Mat(rows_, cols_, CV_8UC(channels_),
+                     file_->data() + k * frame_bytes_);
+    }
+
+    // Drops rows [row_begin, row_end) of frame k from memory, see
+    // MappedFile::Release.
+    void Release(int k, int row_begin, int row_end) const {
+      size_t row_bytes = static_cast<size_t>(cols_) * channels_;
+      file_->Release(k * frame_bytes_ + row_begin * row_bytes,
+                     (row_end - row_begin) * row_bytes);
+    }
+
+  private:
+    RawFrameFile(std::shared_ptr<MappedFile> file, int rows, int cols,
+                 int channels)
+      : file_(std::move(file)), rows_(rows), cols_(cols),
+        channels_(channels),
+        frame_bytes_(static_cast<size_t>(rows) * cols * channels) {}
+
+    std::shared_ptr<MappedFile> file_;
+    int rows_;
+    int cols_;
+    int channels_;
+    size_t frame_bytes_;
+  };
+
+
+  // ---------- Tiled Matching ----------
+  struct TiledMatchOptions {
+    // Source features, which must be built the same way as the
+    // template BlockFeatureImages. Tiles always run HOG_FUSED, the
+    // engine that accepts a gray range from outside the tile.
+    HogOptions hog {6, 9, false, HOG_FUSED};
+    int block_size = 3;
+    int stride = 6;
+
+    // Solver for every template in every tile. The sparse solver's
+    // cost follows the template, not the tile, which keeps the many
+    // per-tile solves affordable, and its vote is robust to a tile
+    // that holds only clutter.
+    SparsePatchMatchOptions matching;
+
+    // Frame pixels owned by one tile. Each tile also computes a halo
+    // below and to the right of it as large as the largest template,
+    // so peak memory follows (tile + template) size, not frame size.
+    int tile_height = 512;
+    int tile_width = 512;
+  };
+
+  struct TileMatch {
+    // Index into the template list passed to TiledMatcher.
+    int template_id = 0;
+    // The tile, in frame pixels, halo excluded.
+    cv::Rect tile;
+    // Where the template lands in the frame, always inside tile.
+    Transform transform;
+    // Selected template patches that voted for transform.
+    int support = 0;
+    // Average per-patch distance of the template placed rigidly at
+    // transform, comparable between tiles.
+    double energy = std::numeric_limits<double>::max();
+    bool found = false;
+  };
+
+  typedef std::function<void(const TileMatch&)> TileObserver;
+
+  // Matches templates against frames of any size, one tile at a time.
+  // A frame is read twice: once for its gray range and once tile by
+  // tile, so that every tile normalizes gray levels like the whole
+  // frame would and its features equal the whole-frame ones. Within a
+  // tile, each template is solved with SparsePatchMatch, placed at the
+  // voted transform and kept when that placement starts inside the
+  // tile; the halo guarantees the template fits there, and every
+  // placement is owned by exactly one tile.
+  //
+  // The feature and block buffers are reused from tile to tile and
+  // frame to frame.
+  template <typename Distance = algebra::L2>
+  class TiledMatcher {
+  public:
+    TiledMatcher(const std::vector<const BlockFeatureImage<float>*> &templates,
+                 const TiledMatchOptions &options)
+      : templates_(templates), options_(options), extent_y_(0),
+        extent_x_(0) {
+      options_.hog.engine = HOG_FUSED;
+      options_.tile_height = std::max(options_.tile_height, 1);
+      options_.tile_width = std::max(options_.tile_width, 1);
+      const int extent = (options_.block_size - 1) * options_.stride;
+      for (const BlockFeatureImage<float> *target : templates_) {
+        if (target->block_size != options_.block_size ||
+            target->stride != options_.stride) {
+          printf("[ERROR] template blocks differ from the tiled options.\n");
+          exit(-1);
+        }
+        extent_y_ = std::max(extent_y_, target->height + extent - 1);
+        extent_x_ = std::max(extent_x_, target->width + extent - 1);
+        salient_.emplace_back(*target, options_.matching);
+      }
+      options_.matching.solver.verbose = false;
+    }
+
+    // The best placement of every template over the whole frame, by
+    // energy. observer, when given, receives every tile's placements
+    // as soon as the tile is done. The result is valid until the next
+    // call.
+    const std::vector<TileMatch> &Match(const cv::Mat &frame,
+                                        const TileObserver &observer =
+                                        nullptr) {
+      return Match(frame, observer, [](int, int) {});
+    }
+
+    // Same as above for frame k of file, whose rows are released from
+    // memory once no remaining tile reads them.
+    const std::vector<TileMatch> &Match(const RawFrameFile &file, int k,
+                                        const TileObserver &observer =
+                                        nullptr) {
+      return Match(file.frame(k), observer,
+                   [&file, k](int row_begin, int row_end) {
+                     file.Release(k, row_begin, row_end);
+                   });
+    }
+
+  private:
+    // release(row_begin, row_end) is called for rows the rest of the
+    // pass no longer reads.
+    template <typename Release>
+    const std::vector<TileMatch> &Match(const cv::Mat &frame,
+                                        const TileObserver &observer,
+                                        Release release) {
+      if (CV_8U != frame.depth() || (1 != frame.channels() &&
+                                     3 != frame.channels() &&
+                                     4 != frame.channels())) {
+        printf("[ERROR] tiled matching needs 8-bit gray, BGR or BGRA "
+               "frames.\n");
+        exit(-1);
+      }
+      const int count = static_cast<int>(templates_.size());
+      best_.assign(count, TileMatch());
+      for (int k = 0; k < count; ++k) {
+        best_[k].template_id = k;
+      }
+
+      // Gray range, band by band.
+      const int tile_height = options_.tile_height;
+      const int tile_width = options_.tile_width;
+      GrayRange range {255, 0};
+      for (int y = 0; y < frame.rows; y += tile_height) {
+        int y1 = std::min(y + tile_height, frame.rows);
+        range.Merge(HogGen::FindGrayRange(frame.rowRange(y, y1),
+                                          options_.hog.threads));
+        release(y, y1);
+      }
+
+      // Tiles, a row of them at a time.
+      int released = 0;
+      for (int y = 0; y < frame.rows; y += tile_height) {
+        for (int x = 0; x < frame.cols; x += tile_width) {
+          cv::Rect tile(x, y, std::min(tile_width, frame.cols - x),
+                        std::min(tile_height, frame.rows - y));
+          MatchTile(frame, range, tile, observer);
+        }
+        // The next row of tiles reads from one row above it.
+        int next = std::min(y + tile_height, frame.rows) - 1;
+        if (next > released) {
+          release(released, next);
+          released = next;
+        }
+      }
+      release(released, frame.rows);
+      return best_;
+    }
+
+    void MatchTile(const cv::Mat &frame, const GrayRange &range,
+                   const cv::Rect &tile, const TileObserver &observer) {
+      // Feature positions the tile's placements can read, and the
+      // pixels those features are computed from: the cell at (y, x)
+      // covers pixels y .. y + cell_size - 1, and Sobel reads one more
+      // pixel around those.
+      int y1 = std::min(tile.y + tile.height + extent_y_, frame.rows);
+      int x1 = std::min(tile.x + tile.width + extent_x_, frame.cols);
+      cv::Rect crop(std::max(tile.x - 1, 0), std::max(tile.y - 1, 0), 0, 0);
+      crop.width = std::min(x1 + options_.hog.cell_size, frame.cols) - crop.x;
+      crop.height = std::min(y1 + options_.hog.cell_size, frame.rows) -
+        crop.y;
+      HogGen::CreateFused(frame(crop), options_.hog, range, &hog_,
+                          &features_);
+
+      regions_.assign(1, Region {tile.y - crop.y, tile.x - crop.x,
+            y1 - tile.y, x1 - tile.x});
+      if (!source_) {
+        source_.reset(new BlockFeatureImage<float>(
+            &features_, options_.block_size, options_.stride, BLOCK_LAZY,
+            &regions_));
+      } else {
+        source_->Reset(&features_, options_.block_size, options_.stride,
+                       BLOCK_LAZY, &regions_);
+      }
+      const BlockFeatureImage<float> &source = *source_;
+      const RegionMask &valid = *source.regions();
+      if (0 == valid.area()) return;
+
+      for (int k = 0; k < static_cast<int>(templates_.size()); ++k) {
+        const BlockFeatureImage<float> &target = *templates_[k];
+        if (0 == target.height * target.width) continue;
+        SparseMatch vote = SparsePatchMatch<float, Distance>(
+            source, target, salient_[k], options_.matching);
+        const Transform &origin = vote.transform;
+
+        // Keep the placement if this tile owns it and all of it is
+        // valid.
+        TileMatch match;
+        match.template_id = k;
+        match.tile = tile;
+        match.transform.y = crop.y + origin.y;
+        match.transform.x = crop.x + origin.x;
+        match.support = vote.support;
+        if (!tile.contains(cv::Point(match.transform.x,
+                                     match.transform.y)) ||
+            !valid.Contains(origin.y, origin.x) ||
+            !valid.Contains(origin.y + target.height - 1,
+                            origin.x + target.width - 1)) {
+          continue;
+        }
+        match.energy = RigidEnergy<float, Distance>(source, target, origin);
+        match.found = true;
+        if (observer) observer(match);
+        if (match.energy < best_[k].energy) best_[k] = match;
+      }
+    }
+
+    std::vector<const BlockFeatureImage<float>*> templates_;
+    TiledMatchOptions options_;
+    // Feature rows and columns a placement spans beyond its origin.
+    int extent_y_;
+    int extent_x_;
+    HogWorkspace hog_;
+    FeatureImage<float> features_ {0, 0, 0};
+    std::vector<Region> regions_;
+    std::vector<SalientPatches> salient_;
+    std::unique_ptr<BlockFeatureImage<float> > source_;
+    std::vector<TileMatch> best_;
+  };
+
+}  // namespace icon_fitter
+
+#endif  // _ICON_FITTER_TILED_MATCH_
@@ -0,0 +1,495 @@
+#ifndef _ICON_FITTER_TRANSFORM_SPACE_
+#define _ICON_FITTER_TRANSFORM_SPACE_
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <memory>
+#include <random>
+#include <vector>
+
+#include "opencv2/imgproc.hpp"
+
+#include "algebra.h"
+#include "feature_image.h"
+#include "hog.h"
+#include "patchmatch.h"
+
+namespace icon_fitter {
+
+  // Translation plus discrete scale and rotation. The target patch at
+  // (i, j), with the template rotated by `rotation` orientation bins,
+  // matches the patch at (i + y, j + x) of source scale level `scale`.
+  struct ScaledTransform {
+    int y = 0;
+    int x = 0;
+    int scale = 0;
+    int rotation = 0;
+  };
+
+  typedef DataMatrix<ScaledTransform> ScaledTransformMap;
+
+  struct TransformSpaceOptions {
+    HogOptions hog {6, 9, false};
+    int block_size = 3;
+    int stride = 6;
+
+    // Sizes of the logo in the frame relative to the template.
+    std::vector<double> scales {0.75, 1.0, 1.25};
+
+    // Rotations tried, from -max_rotation to max_rotation orientation
+    // bins. One bin is 180 / bins degrees (360 / bins if signed).
+    int max_rotation = 1;
+
+    PatchMatchOptions patchmatch;
+  };
+
+  // Rotating the image by one orientation bin moves every histogram
+  // entry up one bin (cyclically), so a rotated HOG image is a bin
+  // shift away rather than a full recomputation. Cell layout is left
+  // as is, which is a fair approximation for small rotations.
+  inline FeatureImage<float> RotateOrientationBins(
+      const FeatureImage<float> &image, int shift) {
+    FeatureImage<float> rotated(image.height, image.width, image.depth);
+    int depth = image.depth;
+    shift = ((shift % depth) + depth) % depth;
+    for (int id = 0; id < image.size(); ++id) {
+      const float *in = image.feature(id);
+      float *out = rotated.mutable_feature(id);
+      for (int b = 0; b < depth; ++b) {
+        out[(b + shift) % depth] = in[b];
+      }
+    }
+    return rotated;
+  }
+
+  // Frame features at every candidate scale. Level k is the frame
+  // resized by 1 / scales[k], so that a logo scales[k] times the
+  // template size appears at template size.
+  class ScaleSpaceSource {
+  public:
+    ScaleSpaceSource(const cv::Mat &frame,
+                     const TransformSpaceOptions &options)
+      : scales_(options.scales) {
+      for (double scale : scales_) {
+        cv::Mat resized;
+        cv::resize(frame, resized,
+                   cv::Size(cvRound(frame.cols / scale),
+                            cvRound(frame.rows / scale)),
+                   0, 0, scale > 1.0 ? cv::INTER_AREA : cv::INTER_LINEAR);
+        features_.emplace_back(new FeatureImage<float>(
+            HogGen::Create(resized, options.hog)));
+        blocks_.emplace_back(new BlockFeatureImage<float>(
+            features_.back().get(), options.block_size, options.stride));
+      }
+    }
+
+    int levels() const {
+      return static_cast<int>(blocks_.size());
+    }
+
+    const BlockFeatureImage<float> &level(int id) const {
+      return *blocks_[id];
+    }
+
+    double scale(int id) const {
+      return scales_[id];
+    }
+
+  private:
+    std::vector<double> scales_;
+    std::vector<std::unique_ptr<FeatureImage<float> > > features_;
+    std::vector<std::unique_ptr<BlockFeatureImage<float> > > blocks_;
+  };
+
+  // The template at every candidate rotation. Comparing a rotated
+  // template with the frame is equivalent to comparing the template
+  // with the counter-rotated frame, and the template is the small side,
+  // so rotations live here. Level r holds rotation r - max_rotation.
+  class RotatedTemplates {
+  public:
+    RotatedTemplates(const FeatureImage<float> &image,
+                     const TransformSpaceOptions &options)
+      : max_rotation_(options.max_rotation) {
+      for (int r = -max_rotation_; r <= max_rotation_; ++r) {
+        features_.emplace_back(new FeatureImage<float>(
+            RotateOrientationBins(image, r)));
+        blocks_.emplace_back(new BlockFeatureImage<float>(
+            features_.back().get(), options.block_size, options.stride,
+            BLOCK_MATERIALIZED));
+      }
+    }
+
+    int levels() const {
+      return static_cast<int>(blocks_.size());
+    }
+
+    const BlockFeatureImage<float> &level(int id) const {
+      return *blocks_[id];
+    }
+
+    // Rotation, in orientation bins, of level id.
+    int rotation(int id) const {
+      return id - max_rotation_;
+    }
+
+  private:
+    int max_rotation_;
+    std::vector<std::unique_ptr<FeatureImage<float> > > features_;
+    std::vector<std::unique_ptr<BlockFeatureImage<float> > > blocks_;
+  };
+
+  // Where the template was found, in frame pixels.
+  struct ScaledMatch {
+    int y = 0;
+    int x = 0;
+    double scale = 1.0;
+    // In orientation bins.
+    int rotation = 0;
+    // Fraction of target patches that voted for this scale and rotation.
+    double support = 0.0;
+  };
+
+  namespace {
+    template <typename Distance>
+    struct ScaledSearch {
+      const ScaleSpaceSource &source;
+      const RotatedTemplates &target;
+
+      inline bool Valid(int scale, int y, int x) const {
+        const BlockFeatureImage<float> &level = source.level(scale);
+        return 0 <= y && y < level.height && 0 <= x && x < level.width;
+      }
+
+      // Tries source location (y, x) of level `scale` with template
+      // rotation level `rotation` for target patch (i, j).
+      inline bool Try(int i, int j, int scale, int rotation, int y, int x,
+                      ScaledTransform *transform, double *score,
+                      long long *evaluations) const {
+        if (!Valid(scale, y, x)) return false;
+        ++*evaluations;
+        Transform moved;
+        if (!TryCandidate<float, Distance>(
+                source.level(scale), target.level(rotation).GetPatch(i, j),
+                i, j, y, x, &moved, score)) {
+          return false;
+        }
+        transform->y = moved.y;
+        transform->x = moved.x;
+        transform->scale = scale;
+        transform->rotation = rotation;
+        return true;
+      }
+
+      // Moves a level `from` location to the same frame point in level
+      // `to`.
+      inline int Rescale(int position, int from, int to) const {
+        return cvRound(position * source.scale(from) / source.scale(to));
+      }
+    };
+
+    // ScanRows over the transform space: target rows [row_begin,
+    // row_end) in the order of control, reading rows outside that
+    // range from halo. Step times are only taken when stats is given.
+    template <typename Distance>
+    ScanDelta ScaledScanRows(const ScaledSearch<Distance> &search,
+                             const PatchMatchOptions &options,
+                             const PatchMatchControl &control,
+                             int row_begin, int row_end,
+                             std::mt19937 *generator,
+                             const ScaledTransformMap *halo,
+                             ScaledTransformMap *result,
+                             DataMatrix<double> *score_map,
+                             PatchMatchStats *stats) {
+      const int height = result->height;
+      const int width = result->width;
+      long long search_evaluations = 0;
+      long long propagation_evaluations = 0;
+      StatsClock::duration search_time = StatsClock::duration::zero();
+      StatsClock::duration propagation_time = StatsClock::duration::zero();
+      ScanDelta delta;
+      int first = control.y_delta > 0 ? row_begin : row_end - 1;
+      int last = control.y_delta > 0 ? row_end : row_begin - 1;
+      for (int i = first; i != last; i += control.y_delta) {
+        for (int j = control.x_begin; j != control.x_end;
+             j += control.x_delta) {
+          ScaledTransform &transform = (*result)(i, j);
+          double &score = (*score_map)(i, j);
+          const double initial_score = score;
+          StatsClock::time_point start;
+          if (nullptr != stats) start = StatsClock::now();
+
+          // Random Search, within the current scale and rotation
+          const BlockFeatureImage<float> &level =
+            search.source.level(transform.scale);
+          BoundaryChecker in_boundary {level.height, level.width, nullptr};
+          double radius = std::max(level.height, level.width);
+          if (0 < options.max_search_radius &&
+              options.max_search_radius < radius) {
+            radius = options.max_search_radius;
+          }
+          Transform moved;
+          moved.y = transform.y;
+          moved.x = transform.x;
+          bool updated = RandomSearch<float, Distance>(
+              level, search.target.level(transform.rotation).GetPatch(i, j),
+              i, j, radius, options.decay_rate, in_boundary, *generator,
+              &moved, &score, &search_evaluations);
+          if (updated) {
+            transform.y = moved.y;
+            transform.x = moved.x;
+          }
+
+          // Neighbouring scales and rotations
+          {
+            ScaledTransform current = transform;
+            int y0 = i + current.y;
+            int x0 = j + current.x;
+            for (int d = -1; d <= 1; d += 2) {
+              int s = current.scale + d;
+              if (0 <= s && s < search.source.levels()) {
+                updated |= search.Try(i, j, s, current.rotation,
+                                      search.Rescale(y0, current.scale, s),
+                                      search.Rescale(x0, current.scale, s),
+                                      &transform, &score,
+                                      &search_evaluations);
+              }
+              int r = current.rotation + d;
+              if (0 <= r && r < search.target.levels()) {
+                updated |= search.Try(i, j, current.scale, r, y0, x0,
+                                      &transform, &score,
+                                      &search_evaluations);
+              }
+            }
+          }
+          StatsClock::time_point searched;
+          if (nullptr != stats) searched = StatsClock::now();
+
+          // Propagation, which carries scale and rotation along
+          int new_i = i - control.y_delta;
+          if (0 <= new_i && new_i < height) {
+            ScaledTransform neighbor =
+              (row_begin <= new_i && new_i < row_end) ?
+              result->Get(new_i, j) : halo->Get(new_i, j);
+            updated |= search.Try(i, j, neighbor.scale, neighbor.rotation,
+                                  i + neighbor.y, j + neighbor.x,
+                                  &transform, &score,
+                                  &propagation_evaluations);
+          }
+          int new_j = j - control.x_delta;
+          if (0 <= new_j && new_j < width) {
+            ScaledTransform neighbor = result->Get(i, new_j);
+            updated |= search.Try(i, j, neighbor.scale, neighbor.rotation,
+                                  i + neighbor.y, j + neighbor.x,
+                                  &transform, &score,
+                                  &propagation_evaluations);
+          }
+          if (updated) {
+            delta.updates++;
+            delta.energy += score - initial_score;
+          }
+          if (nullptr != stats) {
+            propagation_time += StatsClock::now() - searched;
+            search_time += searched - start;
+          }
+        }  // for j
+      }  // for i
+      if (nullptr != stats) {
+        stats->search_evaluations += search_evaluations;
+        stats->propagation_evaluations += propagation_evaluations;
+        stats->search_ms += Milliseconds(search_time);
+        stats->propagation_ms += Milliseconds(propagation_time);
+      }
+      return delta;
+    }
+  }  // namespace
+
+  // PatchMatch over translation x scale x rotation in one pass. Besides
+  // the usual random search and propagation (which carries scale and
+  // rotation along with the offset), every patch also tries the
+  // neighbouring scales at the rescaled location and the neighbouring
+  // rotations in place. options.threads and options.observer work as
+  // in PatchMatch: rounds run on row bands that exchange matches once
+  // per round, and the observer receives PatchMatchStats after
+  // initialization and every round.
+  template <typename Distance = algebra::L2>
+  ScaledTransformMap ScaledPatchMatch(const ScaleSpaceSource &source,
+                                      const RotatedTemplates &target,
+                                      PatchMatchOptions options) {
+    if (0 == source.levels() || 0 == target.levels()) {
+      printf("[ERROR] empty scale or rotation set.");
+      exit(-1);
+    }
+    for (int s = 0; s < source.levels(); ++s) {
+      if (source.level(s).dimension != target.level(0).dimension) {
+        printf("[ERROR] dimension mismatch between source and target.");
+        exit(-1);
+      }
+    }
+    const int height = target.level(0).height;
+    const int width = target.level(0).width;
+    const int size = height * width;
+    ScaledSearch<Distance> search {source, target};
+    ScaledTransformMap result(height, width);
+    DataMatrix<double> score_map(height, width);
+    if (0 == size) return result;
+
+    // Random generators, one per worker thread
+    const bool parallel = 1 != options.threads;
+    const bool observed = static_cast<bool>(options.observer);
+    std::vector<std::mt19937> generators;
+    MakeGenerators(parallel ? ResolveThreads(options.threads) : 1,
+                   &generators);
+    const int threads = static_cast<int>(generators.size());
+
+    // Initialization
+    PatchMatchStats stats;
+    StatsClock::time_point start;
+    if (observed) start = StatsClock::now();
+    const int candidates = std::max(options.initial_candidates, 1);
+#pragma omp parallel for schedule(static) num_threads(threads) if (threads > 1)
+    for (int i = 0; i < height; ++i) {
+      std::mt19937 &generator = generators[ThreadIndex()];
+      std::uniform_int_distribution<int> scale_random(0, source.levels() - 1);
+      std::uniform_int_distribution<int> rotation_random(
+          0, target.levels() - 1);
+      std::uniform_real_distribution<double> unit(0.0, 1.0);
+      long long evaluations = 0;
+      for (int j = 0; j < width; ++j) {
+        double &score = score_map(i, j);
+        score = std::numeric_limits<double>::infinity();
+        for (int k = 0; k < candidates; ++k) {
+          int s = scale_random(generator);
+          const BlockFeatureImage<float> &level = source.level(s);
+          if (0 == level.height * level.width) continue;
+          int y = static_cast<int>(unit(generator) * level.height);
+          int x = static_cast<int>(unit(generator) * level.width);
+          search.Try(i, j, s, rotation_random(generator),
+                     std::min(y, level.height - 1),
+                     std::min(x, level.width - 1),
+                     &result(i, j), &score, &evaluations);
+        }
+      }
+    }
+    double energy = 0.0;
+    for (double score : score_map.data()) {
+      energy += score;
+    }
+    if (observed) {
+      stats.initial_evaluations = static_cast<long long>(candidates) * size;
+      stats.energy = energy;
+      stats.total_ms = Milliseconds(StatsClock::now() - start);
+      options.observer(stats);
+    }
+    if (options.verbose) {
+      printf("Initial Energy: %.6lf\n", energy);
+    }
+
+    // Iterations
+    PatchMatchControl control(height, width);
+    const int bands = std::min(threads, height);
+    ScaledTransformMap halo(0, 0);
+    std::vector<ScanDelta> band_deltas;
+    std::vector<PatchMatchStats> band_stats;
+    for (int round = 0; round < options.iterations; ++round) {
+      if (observed) {
+        stats = PatchMatchStats();
+        stats.round = round;
+        start = StatsClock::now();
+      }
+      ScanDelta delta;
+      if (parallel) {
+        halo.CopyFrom(result);
+        band_deltas.assign(bands, ScanDelta());
+        band_stats.assign(observed ? bands : 0, PatchMatchStats());
+#pragma omp parallel for schedule(static, 1) num_threads(bands)
+        for (int band = 0; band < bands; ++band) {
+          int row_begin = static_cast<int>(
+              static_cast<long long>(height) * band / bands);
+          int row_end = static_cast<int>(
+              static_cast<long long>(height) * (band + 1) / bands);
+          band_deltas[band] = ScaledScanRows<Distance>(
+              search, options, control, row_begin, row_end,
+              &generators[band], &halo, &result, &score_map,
+              observed ? &band_stats[band] : nullptr);
+        }
+        for (const ScanDelta &band : band_deltas) {
+          delta += band;
+        }
+        for (const PatchMatchStats &band : band_stats) {
+          stats.search_evaluations += band.search_evaluations;
+          stats.propagation_evaluations += band.propagation_evaluations;
+          stats.search_ms += band.search_ms;
+          stats.propagation_ms += band.propagation_ms;
+        }
+      } else {
+        delta = ScaledScanRows<Distance>(
+            search, options, control, 0, height, &generators[0], &result,
+            &result, &score_map, observed ? &stats : nullptr);
+      }
+      energy += delta.energy;
+      if (observed) {
+        stats.updates = delta.updates;
+        stats.energy = energy;
+        stats.total_ms = Milliseconds(StatsClock::now() - start);
+        options.observer(stats);
+      }
+      if (options.verbose) {
+        printf("Round %d Energy: %.6lf\n", round, energy);
+      }
+      if (delta.updates < static_cast<int>(
+              size * options.termination_update_rate)) {
+        if (options.verbose) printf("Early termination.\n");
+        break;
+      }
+      control.Switch();
+    }  // for round
+
+    return result;
+  }
+
+  // The (scale, rotation) pair most target patches agree on, with the
+  // mean offset of those patches mapped back to frame pixels.
+  inline ScaledMatch DominantScaledMatch(const ScaledTransformMap &map,
+                                         const ScaleSpaceSource &source,
+                                         const RotatedTemplates &target) {
+    ScaledMatch match;
+    if (0 == map.height * map.width) return match;
+    int rotations = target.levels();
+    std::vector<int> votes(source.levels() * rotations, 0);
+    for (int i = 0; i < map.height; ++i) {
+      for (int j = 0; j < map.width; ++j) {
+        const ScaledTransform &t = map.Get(i, j);
+        votes[t.scale * rotations + t.rotation]++;
+      }
+    }
+    int best = static_cast<int>(
+        std::max_element(votes.begin(), votes.end()) - votes.begin());
+    int scale = best / rotations;
+    int rotation = best % rotations;
+
+    double y = 0.0;
+    double x = 0.0;
+    for (int i = 0; i < map.height; ++i) {
+      for (int j = 0; j < map.width; ++j) {
+        const ScaledTransform &t = map.Get(i, j);
+        if (t.scale == scale && t.rotation == rotation) {
+          y += t.y;
+          x += t.x;
+        }
+      }
+    }
+    match.scale = source.scale(scale);
+    match.rotation = target.rotation(rotation);
+    match.y = cvRound(y / votes[best] * match.scale);
+    match.x = cvRound(x / votes[best] * match.scale);
+    match.support = static_cast<double>(votes[best]) /
+      (map.height * map.width);
+    return match;
+  }
+
+}  // namespace icon_fitter
+
+#endif  // _ICON_FITTER_TRANSFORM_SPACE_
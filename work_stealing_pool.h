@@ -0,0 +1,168 @@
+#ifndef _ICON_FITTER_WORK_STEALING_POOL_
+#define _ICON_FITTER_WORK_STEALING_POOL_
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace icon_fitter {
+
+  // A fixed set of worker threads, each with its own deque of tasks.
+  // A worker runs its newest task first, which keeps the data of a
+  // task it has just spawned hot in its cache, and once its deque is
+  // empty steals the oldest task of another worker. Tasks submitted
+  // from outside the pool are dealt to the workers round robin, tasks
+  // submitted by a worker go to its own deque.
+  class WorkStealingPool {
+  public:
+    typedef std::function<void()> Task;
+
+    // 0 threads uses one per hardware thread.
+    explicit WorkStealingPool(int threads = 0)
+      : queued_(0), pending_(0), next_(0), stopping_(false) {
+      if (threads < 1) {
+        threads = static_cast<int>(std::thread::hardware_concurrency());
+      }
+      if (threads < 1) threads = 1;
+      for (int k = 0; k < threads; ++k) {
+        queues_.emplace_back(new Queue);
+      }
+      for (int k = 0; k < threads; ++k) {
+        workers_.emplace_back([this, k]() { Work(k); });
+      }
+    }
+
+    WorkStealingPool(const WorkStealingPool &) = delete;
+    WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+    // Runs every task already submitted, then stops the workers.
+    ~WorkStealingPool() {
+      Wait();
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        stopping_ = true;
+      }
+      wake_.notify_all();
+      for (std::thread &worker : workers_) {
+        worker.join();
+      }
+    }
+
+    void Submit(Task task) {
+      int index = WorkerIndex();
+      if (index < 0) {
+        index = static_cast<int>(next_++ % queues_.size());
+      }
+      ++pending_;
+      {
+        std::lock_guard<std::mutex> lock(queues_[index]->mutex);
+        queues_[index]->tasks.push_back(std::move(task));
+      }
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        ++queued_;
+      }
+      wake_.notify_one();
+    }
+
+    // Blocks until every submitted task, including the ones submitted
+    // by running tasks, has finished.
+    void Wait() {
+      std::unique_lock<std::mutex> lock(mutex_);
+      idle_.wait(lock, [this]() { return 0 == pending_.load(); });
+    }
+
+    int threads() const {
+      return static_cast<int>(workers_.size());
+    }
+
+  private:
+    struct Queue {
+      std::mutex mutex;
+      std::deque<Task> tasks;
+    };
+
+    // The pool and worker index of the calling thread, if it is a
+    // worker.
+    struct Identity {
+      const WorkStealingPool *pool;
+      int index;
+    };
+
+    static Identity &CurrentWorker() {
+      static thread_local Identity identity {nullptr, -1};
+      return identity;
+    }
+
+    int WorkerIndex() const {
+      const Identity &identity = CurrentWorker();
+      return this == identity.pool ? identity.index : -1;
+    }
+
+    bool Pop(int index, Task *task) {
+      Queue &own = *queues_[index];
+      {
+        std::lock_guard<std::mutex> lock(own.mutex);
+        if (!own.tasks.empty()) {
+          *task = std::move(own.tasks.back());
+          own.tasks.pop_back();
+          return true;
+        }
+      }
+      int count = static_cast<int>(queues_.size());
+      for (int k = 1; k < count; ++k) {
+        Queue &victim = *queues_[(index + k) % count];
+        std::lock_guard<std::mutex> lock(victim.mutex);
+        if (!victim.tasks.empty()) {
+          *task = std::move(victim.tasks.front());
+          victim.tasks.pop_front();
+          return true;
+        }
+      }
+      return false;
+    }
+
+    void Work(int index) {
+      CurrentWorker() = Identity {this, index};
+      Task task;
+      while (true) {
+        {
+          std::unique_lock<std::mutex> lock(mutex_);
+          wake_.wait(lock, [this]() { return stopping_ || queued_ > 0; });
+          if (0 == queued_ && stopping_) return;
+        }
+        if (!Pop(index, &task)) continue;
+        {
+          std::lock_guard<std::mutex> lock(mutex_);
+          --queued_;
+        }
+        task();
+        task = nullptr;
+        if (0 == --pending_) {
+          std::lock_guard<std::mutex> lock(mutex_);
+          idle_.notify_all();
+        }
+      }
+    }
+
+    std::vector<std::unique_ptr<Queue> > queues_;
+    std::vector<std::thread> workers_;
+    std::mutex mutex_;
+    std::condition_variable wake_;
+    std::condition_variable idle_;
+    // Tasks sitting in a deque, guarded by mutex_.
+    int queued_;
+    // Tasks submitted and not yet finished.
+    std::atomic<int> pending_;
+    std::atomic<unsigned> next_;
+    bool stopping_;
+  };
+
+}  // namespace icon_fitter
+
+#endif  // _ICON_FITTER_WORK_STEALING_POOL_